@@ -0,0 +1,619 @@
+/*
+ *
+ * device driver for TW6869 based PCIe capture cards
+ * frame copy kernels for the copy capture path
+ *
+ * The capture buffer is not read by the CPU before userspace gets it,
+ * so on x86 it is written with non-temporal stores that go around the
+ * cache instead of evicting everything else on every field.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/timex.h>
+#include <linux/version.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#endif
+
+#include "TW68.h"
+
+static int copy_kernel = -1;
+module_param(copy_kernel, int, 0444);
+MODULE_PARM_DESC(copy_kernel, "frame copy: -1 best available, 0 memcpy, 1 SSE2 non-temporal, 2 AVX non-temporal");
+
+/* FPU sections are split so preemption stays off for at most this long */
+#define TW68_COPY_CHUNK	(64 * 1024)
+
+typedef void (*TW68_copy_fn) (void *dst, const void *src, size_t n);
+
+#ifdef CONFIG_X86
+/* n is a multiple of 64, dst is 16 byte aligned */
+static void copy_nt_sse2(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 64, src += 64, dst += 64)
+		asm volatile ("prefetchnta 256(%0)\n\t"
+			      "movdqu   (%0), %%xmm0\n\t"
+			      "movdqu 16(%0), %%xmm1\n\t"
+			      "movdqu 32(%0), %%xmm2\n\t"
+			      "movdqu 48(%0), %%xmm3\n\t"
+			      "movntdq %%xmm0,   (%1)\n\t"
+			      "movntdq %%xmm1, 16(%1)\n\t"
+			      "movntdq %%xmm2, 32(%1)\n\t"
+			      "movntdq %%xmm3, 48(%1)\n\t"
+			      : : "r" (src), "r" (dst) : "memory");
+}
+
+/* n is a multiple of 128, dst is 32 byte aligned */
+static void copy_nt_avx(void *dst, const void *src, size_t n)
+{
+	for (; n; n -= 128, src += 128, dst += 128)
+		asm volatile ("prefetchnta 512(%0)\n\t"
+			      "vmovdqu    (%0), %%ymm0\n\t"
+			      "vmovdqu  32(%0), %%ymm1\n\t"
+			      "vmovdqu  64(%0), %%ymm2\n\t"
+			      "vmovdqu  96(%0), %%ymm3\n\t"
+			      "vmovntdq %%ymm0,   (%1)\n\t"
+			      "vmovntdq %%ymm1, 32(%1)\n\t"
+			      "vmovntdq %%ymm2, 64(%1)\n\t"
+			      "vmovntdq %%ymm3, 96(%1)\n\t"
+			      : : "r" (src), "r" (dst) : "memory");
+}
+#endif
+
+static const struct {
+	const char *name;
+	TW68_copy_fn fn;
+	size_t align;		/* dst alignment the kernel needs */
+	size_t block;		/* bytes per loop */
+} TW68_copy_kernels[] = {
+	{ "memcpy", NULL, 1, 1 },
+#ifdef CONFIG_X86
+	{ "sse2-nt", copy_nt_sse2, 16, 64 },
+	{ "avx-nt", copy_nt_avx, 32, 128 },
+#endif
+};
+
+static int TW68_copy_sel;	// index into TW68_copy_kernels
+
+static int TW68_copy_usable(int k)
+{
+	if (k <= 0 || k >= ARRAY_SIZE(TW68_copy_kernels))
+		return k == 0;
+#ifdef CONFIG_X86
+	if (k == 1)
+		return boot_cpu_has(X86_FEATURE_XMM2);
+	if (k == 2)
+		return boot_cpu_has(X86_FEATURE_AVX);
+#endif
+	return 0;
+}
+
+/* copy one run: cached head up to the alignment, streamed body, cached tail */
+static void TW68_copy_run(int k, void *dst, const void *src, size_t n)
+{
+	size_t head, body;
+
+	head = (-(unsigned long)dst) & (TW68_copy_kernels[k].align - 1);
+	if (head > n)
+		head = n;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+
+	body = n & ~(TW68_copy_kernels[k].block - 1);
+	if (body)
+		TW68_copy_kernels[k].fn(dst, src, body);
+	memcpy(dst + body, src + body, n - body);
+}
+
+#ifdef CONFIG_X86
+static int TW68_copy_fpu(void)
+{
+	return irq_fpu_usable();
+}
+
+static void TW68_copy_begin(void)
+{
+	kernel_fpu_begin();
+}
+
+static void TW68_copy_end(void)
+{
+	asm volatile ("sfence" : : : "memory");	// order the streamed stores
+	kernel_fpu_end();
+}
+#else
+static int TW68_copy_fpu(void)
+{
+	return 0;
+}
+
+static void TW68_copy_begin(void)
+{
+}
+
+static void TW68_copy_end(void)
+{
+}
+#endif
+
+static void TW68_copy_frame_with(int k, void *dst, const void *src, size_t n)
+{
+	size_t len;
+
+	if (k == 0 || !TW68_copy_fpu()) {
+		memcpy(dst, src, n);
+		return;
+	}
+	while (n) {
+		len = min_t(size_t, n, TW68_COPY_CHUNK);
+		TW68_copy_begin();
+		TW68_copy_run(k, dst, src, len);
+		TW68_copy_end();
+		dst += len;
+		src += len;
+		n -= len;
+	}
+}
+
+static void TW68_copy_rows_with(int k, void *dst, size_t dpitch,
+				const void *src, size_t spitch,
+				size_t width, unsigned int rows)
+{
+	unsigned int h, batch;
+
+	if (k == 0 || !TW68_copy_fpu()) {
+		for (h = 0; h < rows; h++)
+			memcpy(dst + h * dpitch, src + h * spitch, width);
+		return;
+	}
+	batch = max_t(size_t, 1, TW68_COPY_CHUNK / max_t(size_t, width, 1));
+	for (h = 0; h < rows; h++) {
+		if (h % batch == 0)
+			TW68_copy_begin();
+		TW68_copy_run(k, dst + h * dpitch, src + h * spitch, width);
+		if (h % batch == batch - 1 || h == rows - 1)
+			TW68_copy_end();
+	}
+}
+
+/* copy n contiguous bytes into a capture buffer */
+void TW68_copy_frame(void *dst, const void *src, size_t n)
+{
+	TW68_copy_frame_with(TW68_copy_sel, dst, src, n);
+}
+
+/* copy rows of width bytes, e.g. a QF quadrant into the quad frame */
+void TW68_copy_rows(void *dst, size_t dpitch, const void *src, size_t spitch,
+		    size_t width, unsigned int rows)
+{
+	TW68_copy_rows_with(TW68_copy_sel, dst, dpitch, src, spitch, width,
+			    rows);
+}
+
+/*
+ * YUYV as the DMA writes it into NV12 or YUV420 planes, in the same pass
+ * that copies the frame.  The chroma of each row pair is averaged.
+ */
+static void yuyv_420_c(u8 *y0, u8 *cb, u8 *cr, const u8 *s0,
+		       unsigned int spitch, unsigned int width, unsigned int x,
+		       int nv12)
+{
+	const u8 *s1 = s0 + spitch;
+	u8 *y1 = y0 + width;
+
+	for (; x < width; x += 2) {
+		y0[x] = s0[2 * x];
+		y0[x + 1] = s0[2 * x + 2];
+		y1[x] = s1[2 * x];
+		y1[x + 1] = s1[2 * x + 2];
+		if (nv12) {
+			cb[x] = (s0[2 * x + 1] + s1[2 * x + 1] + 1) >> 1;
+			cb[x + 1] = (s0[2 * x + 3] + s1[2 * x + 3] + 1) >> 1;
+		} else {
+			cb[x / 2] = (s0[2 * x + 1] + s1[2 * x + 1] + 1) >> 1;
+			cr[x / 2] = (s0[2 * x + 3] + s1[2 * x + 3] + 1) >> 1;
+		}
+	}
+}
+
+#ifdef CONFIG_X86
+static const u8 yuyv_mask[16] __aligned(16) = {
+	0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0,
+	0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0,
+};
+
+/*
+ * 16 pixels of a row pair per loop, n is a multiple of 16.  xmm7 holds
+ * yuyv_mask, loaded once per FPU section like the raid6 SSE code does.
+ */
+static void yuyv_420_sse2(u8 *y0, u8 *cb, u8 *cr, const u8 *s0,
+			  unsigned int spitch, unsigned int width,
+			  unsigned int n, int nv12)
+{
+	const u8 *s1 = s0 + spitch;
+	u8 *y1 = y0 + width;
+	unsigned int x;
+
+	for (x = 0; x < n; x += 16, s0 += 32, s1 += 32) {
+		asm volatile ("movdqu   (%0), %%xmm0\n\t"
+			      "movdqu 16(%0), %%xmm1\n\t"
+			      "movdqu   (%1), %%xmm2\n\t"
+			      "movdqu 16(%1), %%xmm3\n\t"
+			      /* luma: the even bytes of each row */
+			      "movdqa %%xmm0, %%xmm4\n\t"
+			      "movdqa %%xmm1, %%xmm5\n\t"
+			      "pand %%xmm7, %%xmm4\n\t"
+			      "pand %%xmm7, %%xmm5\n\t"
+			      "packuswb %%xmm5, %%xmm4\n\t"
+			      "movdqu %%xmm4, (%2)\n\t"
+			      "movdqa %%xmm2, %%xmm4\n\t"
+			      "movdqa %%xmm3, %%xmm5\n\t"
+			      "pand %%xmm7, %%xmm4\n\t"
+			      "pand %%xmm7, %%xmm5\n\t"
+			      "packuswb %%xmm5, %%xmm4\n\t"
+			      "movdqu %%xmm4, (%3)\n\t"
+			      /* chroma: the odd bytes, averaged over the pair */
+			      "psrlw $8, %%xmm0\n\t"
+			      "psrlw $8, %%xmm1\n\t"
+			      "psrlw $8, %%xmm2\n\t"
+			      "psrlw $8, %%xmm3\n\t"
+			      "packuswb %%xmm1, %%xmm0\n\t"
+			      "packuswb %%xmm3, %%xmm2\n\t"
+			      "pavgb %%xmm2, %%xmm0\n\t"
+			      : : "r" (s0), "r" (s1), "r" (y0 + x), "r" (y1 + x)
+			      : "memory");
+		if (nv12) {
+			asm volatile ("movdqu %%xmm0, (%0)\n\t"
+				      : : "r" (cb + x) : "memory");
+		} else {
+			asm volatile ("movdqa %%xmm0, %%xmm1\n\t"
+				      "pand %%xmm7, %%xmm1\n\t"
+				      "psrlw $8, %%xmm0\n\t"
+				      "packuswb %%xmm0, %%xmm1\n\t"
+				      "movq %%xmm1, (%0)\n\t"
+				      "psrldq $8, %%xmm1\n\t"
+				      "movq %%xmm1, (%1)\n\t"
+				      : : "r" (cb + x / 2), "r" (cr + x / 2)
+				      : "memory");
+		}
+	}
+}
+#endif
+
+/* spitch: bytes from one source line to the next, 4 * width for a field */
+void TW68_copy_yuyv_420(void *dst, const void *src, unsigned int width,
+			unsigned int height, unsigned int spitch, int nv12)
+{
+	u8 *y = dst, *cb, *cr;
+	const u8 *s = src;
+	unsigned int r, n = 0, batch;
+
+	cb = y + width * height;
+	cr = cb + (width / 2) * (height / 2);
+
+#ifdef CONFIG_X86
+	if (TW68_copy_sel > 0 && TW68_copy_fpu())
+		n = width & ~15;
+#endif
+	batch = max_t(unsigned int, 1, TW68_COPY_CHUNK / (width * 4));
+
+	for (r = 0; r + 1 < height; r += 2) {
+#ifdef CONFIG_X86
+		if (n) {
+			if ((r / 2) % batch == 0) {
+				TW68_copy_begin();
+				asm volatile ("movdqa %0, %%xmm7" : :
+					      "m" (yuyv_mask[0]));
+			}
+			yuyv_420_sse2(y, cb, cr, s, spitch, width, n, nv12);
+			if ((r / 2) % batch == batch - 1 || r + 3 >= height)
+				TW68_copy_end();
+		}
+#endif
+		yuyv_420_c(y, cb, cr, s, spitch, width, n, nv12);
+
+		s += spitch * 2;
+		y += width * 2;
+		if (nv12) {
+			cb += width;
+		} else {
+			cb += width / 2;
+			cr += width / 2;
+		}
+	}
+}
+
+/* GREY: the Y samples of n YUYV pixels */
+static void yuyv_grey_c(u8 *dst, const u8 *src, size_t n)
+{
+	while (n--) {
+		*dst++ = *src;
+		src += 2;
+	}
+}
+
+#ifdef CONFIG_X86
+/* n is a multiple of 32, dst is 16 byte aligned, xmm7 holds yuyv_mask */
+static void yuyv_grey_sse2(u8 *dst, const u8 *src, size_t n)
+{
+	for (; n; n -= 32, src += 64, dst += 32)
+		asm volatile ("prefetchnta 256(%0)\n\t"
+			      "movdqu   (%0), %%xmm0\n\t"
+			      "movdqu 16(%0), %%xmm1\n\t"
+			      "movdqu 32(%0), %%xmm2\n\t"
+			      "movdqu 48(%0), %%xmm3\n\t"
+			      "pand %%xmm7, %%xmm0\n\t"
+			      "pand %%xmm7, %%xmm1\n\t"
+			      "pand %%xmm7, %%xmm2\n\t"
+			      "pand %%xmm7, %%xmm3\n\t"
+			      "packuswb %%xmm1, %%xmm0\n\t"
+			      "packuswb %%xmm3, %%xmm2\n\t"
+			      "movntdq %%xmm0,   (%1)\n\t"
+			      "movntdq %%xmm2, 16(%1)\n\t"
+			      : : "r" (src), "r" (dst) : "memory");
+}
+#endif
+
+static void yuyv_grey_run(void *dst, const void *src, size_t n)
+{
+#ifdef CONFIG_X86
+	size_t head, len;
+
+	if (TW68_copy_sel > 0 && TW68_copy_fpu()) {
+		head = min_t(size_t, n, (-(unsigned long)dst) & 15);
+		yuyv_grey_c(dst, src, head);
+		dst += head;
+		src += head * 2;
+		n -= head;
+		while (n >= 32) {
+			len = min_t(size_t, n, TW68_COPY_CHUNK) & ~31;
+			TW68_copy_begin();
+			asm volatile ("movdqa %0, %%xmm7" : : "m" (yuyv_mask[0]));
+			yuyv_grey_sse2(dst, src, len);
+			TW68_copy_end();
+			dst += len;
+			src += len * 2;
+			n -= len;
+		}
+	}
+#endif
+	yuyv_grey_c(dst, src, n);
+}
+
+void TW68_copy_yuyv_grey(void *dst, const void *src, unsigned int width,
+			 unsigned int height, unsigned int spitch)
+{
+	unsigned int h;
+
+	if (spitch == width * 2) {
+		yuyv_grey_run(dst, src, (size_t)width * height);
+		return;
+	}
+	for (h = 0; h < height; h++)
+		yuyv_grey_run(dst + h * width, src + h * spitch, width);
+}
+
+/*
+ * Progressive frames out of the woven frame the DMA wrote, for packed
+ * formats where averaging bytes of neighbouring lines averages samples:
+ *   weave   the frame as it is
+ *   bob     the top field, every line doubled
+ *   linear  1-2-1 vertical blend of every line with its neighbours
+ *   adapt   bottom field lines that comb against the lines around them
+ *           (moving picture) are replaced by the average of those lines,
+ *           still parts keep the full resolution
+ */
+#define TW68_COMB_THRESH	24
+
+/* avg(avg(a, c), b): the rounding of the SSE2 pavgb path */
+static inline u8 blend3(u8 a, u8 b, u8 c)
+{
+	return (((a + c + 1) >> 1) + b + 1) >> 1;
+}
+
+static void row_blend_c(u8 *d, const u8 *a, const u8 *b, const u8 *c,
+			size_t x, size_t n)
+{
+	for (; x < n; x++)
+		d[x] = blend3(a[x], b[x], c[x]);
+}
+
+static void row_adapt_c(u8 *d, const u8 *a, const u8 *b, const u8 *c,
+			size_t x, size_t n)
+{
+	u8 i;
+
+	for (; x < n; x++) {
+		i = (a[x] + c[x] + 1) >> 1;
+		d[x] = abs(b[x] - i) > TW68_COMB_THRESH ? i : b[x];
+	}
+}
+
+#ifdef CONFIG_X86
+static const u8 comb_thresh[16] __aligned(16) = {
+	[0 ... 15] = TW68_COMB_THRESH
+};
+
+/* n is a multiple of 16 */
+static void row_blend_sse2(u8 *d, const u8 *a, const u8 *b, const u8 *c,
+			   size_t n)
+{
+	size_t x;
+
+	for (x = 0; x < n; x += 16)
+		asm volatile ("movdqu (%1), %%xmm0\n\t"
+			      "movdqu (%3), %%xmm1\n\t"
+			      "pavgb %%xmm1, %%xmm0\n\t"
+			      "movdqu (%2), %%xmm1\n\t"
+			      "pavgb %%xmm1, %%xmm0\n\t"
+			      "movdqu %%xmm0, (%0)\n\t"
+			      : : "r" (d + x), "r" (a + x), "r" (b + x),
+			      "r" (c + x) : "memory");
+}
+
+/* n is a multiple of 16, xmm6 holds comb_thresh */
+static void row_adapt_sse2(u8 *d, const u8 *a, const u8 *b, const u8 *c,
+			   size_t n)
+{
+	size_t x;
+
+	for (x = 0; x < n; x += 16)
+		asm volatile ("movdqu (%1), %%xmm0\n\t"
+			      "movdqu (%3), %%xmm1\n\t"
+			      "pavgb %%xmm1, %%xmm0\n\t"	/* i */
+			      "movdqu (%2), %%xmm1\n\t"	/* b */
+			      "movdqa %%xmm1, %%xmm2\n\t"
+			      "psubusb %%xmm0, %%xmm2\n\t"
+			      "movdqa %%xmm0, %%xmm3\n\t"
+			      "psubusb %%xmm1, %%xmm3\n\t"
+			      "por %%xmm3, %%xmm2\n\t"	/* |b - i| */
+			      "psubusb %%xmm6, %%xmm2\n\t"
+			      "pxor %%xmm3, %%xmm3\n\t"
+			      "pcmpeqb %%xmm3, %%xmm2\n\t"	/* still: keep b */
+			      "pand %%xmm2, %%xmm1\n\t"
+			      "pandn %%xmm0, %%xmm2\n\t"
+			      "por %%xmm2, %%xmm1\n\t"
+			      "movdqu %%xmm1, (%0)\n\t"
+			      : : "r" (d + x), "r" (a + x), "r" (b + x),
+			      "r" (c + x) : "memory");
+}
+#endif
+
+void TW68_copy_deinterlace(void *dst, const void *src, unsigned int pitch,
+			   unsigned int lines, int mode)
+{
+	const u8 *a, *b, *c;
+	unsigned int y, n = 0, fpu = 0;
+	u8 *d;
+
+	if (mode == TW68_DEINT_WEAVE || lines < 2) {
+		TW68_copy_frame(dst, src, (size_t)pitch * lines);
+		return;
+	}
+	if (mode == TW68_DEINT_BOB) {
+		TW68_copy_rows(dst, pitch * 2, src, pitch * 2, pitch,
+			       (lines + 1) / 2);
+		TW68_copy_rows(dst + pitch, pitch * 2, src, pitch * 2, pitch,
+			       lines / 2);
+		return;
+	}
+
+#ifdef CONFIG_X86
+	if (TW68_copy_sel > 0 && TW68_copy_fpu())
+		n = pitch & ~15;
+#endif
+
+	for (y = 0; y < lines; y++) {
+		/* mirrored at the top and bottom edge */
+		a = src + (y ? y - 1 : 1) * pitch;
+		b = src + y * pitch;
+		c = src + (y + 1 < lines ? y + 1 : y - 1) * pitch;
+		d = dst + y * pitch;
+
+		if (mode == TW68_DEINT_ADAPT && !(y & 1)) {
+			memcpy(d, b, pitch);	// top field lines stay
+			continue;
+		}
+#ifdef CONFIG_X86
+		if (n) {
+			if (0 == fpu) {
+				TW68_copy_begin();
+				asm volatile ("movdqa %0, %%xmm6" : :
+					      "m" (comb_thresh[0]));
+			}
+			if (mode == TW68_DEINT_ADAPT)
+				row_adapt_sse2(d, a, b, c, n);
+			else
+				row_blend_sse2(d, a, b, c, n);
+			fpu += pitch;
+			if (fpu >= TW68_COPY_CHUNK) {
+				TW68_copy_end();
+				fpu = 0;
+			}
+		}
+#endif
+		if (mode == TW68_DEINT_ADAPT)
+			row_adapt_c(d, a, b, c, n, pitch);
+		else
+			row_blend_c(d, a, b, c, n, pitch);
+	}
+	if (fpu)
+		TW68_copy_end();
+}
+
+/* load time: copy_kernel=, or the widest kernel the CPU has */
+void TW68_copy_init(void)
+{
+	int k;
+
+	if (copy_kernel >= 0 && TW68_copy_usable(copy_kernel)) {
+		TW68_copy_sel = copy_kernel;
+	} else {
+		if (copy_kernel >= 0)
+			printk(KERN_INFO "TW68_: copy_kernel=%d not available\n",
+			       copy_kernel);
+		TW68_copy_sel = 0;
+		for (k = ARRAY_SIZE(TW68_copy_kernels) - 1; k > 0; k--)
+			if (TW68_copy_usable(k)) {
+				TW68_copy_sel = k;
+				break;
+			}
+	}
+	printk(KERN_INFO "TW68_: frame copy uses %s\n",
+	       TW68_copy_kernels[TW68_copy_sel].name);
+}
+
+/*
+ * bd_bench=1: cycles to copy a D1 frame, as one block and as the four
+ * quadrants of the QF view, for every copy kernel the CPU has
+ */
+void TW68_copy_bench(struct TW68_dev *dev)
+{
+	size_t pitch = 704 * 2, size = pitch * 576;
+	cycles_t t, frame, quad;
+	void *src, *dst;
+	int k, q, r;
+
+	src = vmalloc(size);
+	dst = vmalloc(size);
+	if (NULL == src || NULL == dst)
+		goto out;
+	memset(src, 0x80, size);
+
+	for (k = 0; k < ARRAY_SIZE(TW68_copy_kernels); k++) {
+		if (!TW68_copy_usable(k))
+			continue;
+
+		t = get_cycles();
+		for (r = 0; r < 16; r++)
+			TW68_copy_frame_with(k, dst, src, size);
+		frame = (get_cycles() - t) / 16;
+
+		t = get_cycles();
+		for (r = 0; r < 16; r++)
+			for (q = 0; q < 4; q++)
+				TW68_copy_rows_with(k, dst + (q & 1) * pitch / 2 +
+						    (q >> 1) * size / 2, pitch,
+						    src + q * size / 4, pitch / 2,
+						    pitch / 2, 288);
+		quad = (get_cycles() - t) / 16;
+
+		printk(KERN_INFO "%s: %s %llu cycles/frame, %llu cycles/QF frame\n",
+		       dev->name, TW68_copy_kernels[k].name,
+		       (unsigned long long)frame, (unsigned long long)quad);
+	}
+out:
+	vfree(src);
+	vfree(dst);
+}
@@ -18,6 +18,7 @@
 #include <linux/mutex.h>
 #include <linux/dma-mapping.h>
 #include <linux/pm.h>
+#include <linux/ktime.h>
 #include <linux/vmalloc.h>
 
 #include "TW68.h"
@@ -50,6 +51,38 @@ static unsigned int latency = UNSET;
 module_param(latency, int, 0444);
 MODULE_PARM_DESC(latency, "pci latency timer");
 
+static unsigned int msi;
+module_param(msi, int, 0444);
+MODULE_PARM_DESC(msi, "use a dedicated MSI vector instead of shared INTx (falls back to INTx)");
+
+static unsigned int irq_coalesce;
+module_param(irq_coalesce, int, 0644);
+MODULE_PARM_DESC(irq_coalesce, "0: interrupt per field (lowest latency), 1: adaptive interrupt coalescing");
+
+static unsigned int irq_latency = 8000;
+module_param(irq_latency, int, 0644);
+MODULE_PARM_DESC(irq_latency, "extra field latency in us allowed by irq_coalesce=1");
+
+static unsigned int pool_max = 32;
+module_param(pool_max, int, 0644);
+MODULE_PARM_DESC(pool_max, "released DMA buffers each board keeps for reuse");
+
+static unsigned int bd_streaming;
+module_param(bd_streaming, int, 0644);
+MODULE_PARM_DESC(bd_streaming, "driver frame buffers: 0 uncached coherent, 1 cacheable streaming DMA");
+
+static unsigned int decimate = 1;
+module_param(decimate, int, 0644);
+MODULE_PARM_DESC(decimate, "halve full-size pictures in the channel DMA instead of the scaler");
+
+static unsigned int bd_bench;
+module_param(bd_bench, int, 0444);
+MODULE_PARM_DESC(bd_bench, "time the frame copy out of each kind of driver frame buffer at probe");
+
+static int irq_cpu[] = {[0 ... (TW68_MAXBOARDS - 1)] = -1 };
+module_param_array(irq_cpu, int, NULL, 0444);
+MODULE_PARM_DESC(irq_cpu, "CPU to steer each board's interrupt to (-1: leave to irqbalance)");
+
 static unsigned int video_nr[] = {[0 ... (TW68_MAXBOARDS - 1)] = UNSET };
 static unsigned int vbi_nr[] = {[0 ... (TW68_MAXBOARDS - 1)] = UNSET };
 static unsigned int radio_nr[] = {[0 ... (TW68_MAXBOARDS - 1)] = UNSET };
@@ -87,8 +120,6 @@ static char name_comp4[] = "Composite4";
 /* ------------------------------------------------------------------ */
 /* board config info                                                  */
 
-static DEFINE_MUTEX(TW68_devlist_lock);
-
 struct TW68_board TW68_boards[] = {
 	[TW68_BOARD_UNKNOWN] = {
 		.name = "TW6869",
@@ -276,8 +307,8 @@ int TW68_buffer_count(unsigned int size, unsigned int count)
 int TW68_buffer_startpage(struct TW68_buf *buf)
 {
 	unsigned long pages, n, pgn;
-	pages = TW68_buffer_pages(buf->vb.bsize);
-	n = buf->vb.i;
+	pages = TW68_buffer_pages(buf->size);
+	n = buf->vb.v4l2_buf.index;
 	pgn = pages * n;
 	return pgn;
 }
@@ -354,20 +385,53 @@ void TW68_pgtable_free(struct pci_dev *pci, struct TW68_pgtable *pt)
 
 /* ------------------------------------------------------------------ */
 
+/* called with dev->slock held */
 int TW68_buffer_queue(struct TW68_dev *dev,
 		      struct TW68_dmaqueue *q, struct TW68_buf *buf)
 {
+	if (q->mosaic ? q->mosaic->direct :
+	    dev->capture_mode != TW68_CAPTURE_COPY) {
+		/* picked up by BD_Done()/SG_Done()/QF_Done() when a slot comes free */
+		list_add_tail(&buf->queue, &q->queued);
+		return 0;
+	}
+
 	if (NULL == q->curr) {
 		q->curr = buf;
 		buf->activate(dev, buf, NULL);
 	} else {
-		list_add_tail(&buf->vb.queue, &q->queued);	// curr
-		buf->vb.state = VIDEOBUF_QUEUED;
+		list_add_tail(&buf->queue, &q->queued);	// curr
 	}
 
 	return 0;
 }
 
+/* streaming stopped: hand every buffer the queue still owns back to vb2 */
+void TW68_buffer_cancel(struct TW68_dev *dev, struct TW68_dmaqueue *q,
+			enum vb2_buffer_state state)
+{
+	struct TW68_buf *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	if (q->curr) {
+		vb2_buffer_done(&q->curr->vb, state);
+		q->curr = NULL;
+	}
+	while (!list_empty(&q->queued)) {
+		buf = list_entry(q->queued.next, struct TW68_buf, queue);
+		list_del(&buf->queue);
+		vb2_buffer_done(&buf->vb, state);
+	}
+	/* quad view buffers the channels were still writing */
+	while (!list_empty(&q->active)) {
+		buf = list_entry(q->active.next, struct TW68_buf, queue);
+		list_del(&buf->queue);
+		vb2_buffer_done(&buf->vb, state);
+	}
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
 /* ------------------------------------------------------------------ */
 /*
  * Buffer handling routines
@@ -410,38 +474,22 @@ int TW68_buffer_requeue(struct TW68_dev *dev, struct TW68_dmaqueue *q)
 	}
 }
 #endif 
-void TW68_buffer_finish(struct TW68_dev *dev,
-			struct TW68_dmaqueue *q, unsigned int state)
+/* activate the next queued buffer, called with dev->slock held */
+static void TW68_buffer_activate_next(struct TW68_dev *dev,
+				      struct TW68_dmaqueue *q)
 {
+	struct TW68_buf *buf;
 
-	if (q->dev != dev)
-		return;
-
-	q->curr->vb.state = state;
-	do_gettimeofday(&q->curr->vb.ts);
-
-	wake_up(&q->curr->vb.done);
-	q->curr = NULL;
-}
-
-void TW68_buffer_next(struct TW68_dev *dev, struct TW68_dmaqueue *q)
-{
-	struct TW68_buf *buf, *next = NULL;
-	BUG_ON(NULL != q->curr);
-
-	if (!list_empty(&q->queued)) {
+	if (q->curr) {
+		/* TW68_buffer_queue() found the queue idle and took over */
+		mod_timer(&q->timeout, jiffies + BUFFER_TIMEOUT);
+	} else if (!list_empty(&q->queued)) {
 		/* activate next one from  dma queue */
-		buf = list_entry(q->queued.next, struct TW68_buf, vb.queue);
+		buf = list_entry(q->queued.next, struct TW68_buf, queue);
 
-		list_del(&buf->vb.queue);
-
-		if (!list_empty(&q->queued))
-			next =
-			    list_entry(q->queued.next, struct TW68_buf,
-				       vb.queue);
+		list_del(&buf->queue);
 		q->curr = buf;
-
-		buf->vb.state = VIDEOBUF_ACTIVE;
+		buf->activate(dev, buf, NULL);
 
 		mod_timer(&q->timeout, jiffies + BUFFER_TIMEOUT);
 	} else {
@@ -449,6 +497,33 @@ void TW68_buffer_next(struct TW68_dev *dev, struct TW68_dmaqueue *q)
 		del_timer(&q->timeout);
 	}
 }
+
+/*
+ * Hand q->curr back to vb2 and activate the next queued buffer, in one
+ * dev->slock section so TW68_buffer_queue() never sees the gap.
+ */
+void TW68_buffer_finish(struct TW68_dev *dev,
+			struct TW68_dmaqueue *q, enum vb2_buffer_state state)
+{
+	unsigned long flags;
+
+	if (q->dev != dev)
+		return;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	if (q->curr) {
+		if (q->curr->early_us)
+			q->curr->vb.v4l2_buf.timestamp =
+			    ktime_to_timeval(ktime_sub_us(ktime_get(),
+							  q->curr->early_us));
+		else
+			v4l2_get_timestamp(&q->curr->vb.v4l2_buf.timestamp);
+		vb2_buffer_done(&q->curr->vb, state);
+		q->curr = NULL;
+	}
+	TW68_buffer_activate_next(dev, q);
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
 #if 0
 void Field_SG_Mapping(struct TW68_dev *dev, int field_PB)	//    0 1
 {
@@ -616,81 +691,1179 @@ void Fixed_SG_Mapping(struct TW68_dev *dev, int nDMA_channel, int Frame_size)	//
 		if (remain <= 0)
 			break;
 
-		{
+		{
+
+			dwCtrl = (((DMA_STATUS_HOST_READY & 0x3) << 30) |
+				  (((i == 0) & 1) << 29) |
+				  ((m_CurrentFrameStartIdx & 0x7F) << 14) | 
+				  ((m_NextFrameStartIdx & 0xFF) << 21) | 
+				  ((pgn > 70) << 13) |	///   70
+				  (remain & 0x1FFF));	// size
+
+			*(ptr++) = cpu_to_le32(dwCtrl);
+
+			*(ptr++) = cpu_to_le32(sg_dma_address(sglist) -
+					sglist->offset);	/// setup page dma address
+
+			nbytes += sglist->length;
+		}
+	}
+
+	remain = 0;		/// (nbytes + sglist->length) - FieldSize;
+	nbytes = 0;
+	sglist = Field_B->sglist;
+
+	ptr = (pt->cpu + (2 * nIDX * nId)) + 0x800;	// 2 pages distance  switch to B
+
+	for (i = 0; i < Field_B->n_pages; i++, sglist++) {
+		// switch to B
+		if ((nbytes + sglist->length) <= FieldSize) {
+			remain = sglist->length;
+		} else {
+			remain = FieldSize - nbytes;
+		}
+
+		if (remain <= 0)
+			break;
+
+		dwCtrl = (((DMA_STATUS_HOST_READY & 0x3) << 30) |
+			  (((i == 0) & 1) << 29) |
+			  ((m_CurrentFrameStartIdx & 0x7F) << 14) |	/// 0xFF
+			  ((m_NextFrameStartIdx & 0xFF) << 21)
+				| ((pgn > 70) << 13) | (remain & 0x1FFF));  // size
+
+		*(ptr++) = cpu_to_le32(dwCtrl);
+		/// setup page dma address
+		*(ptr++) = cpu_to_le32(sg_dma_address(sglist) - sglist->offset);
+		nbytes += sglist->length;	/// remain
+	}
+
+}
+#endif
+/*
+ * BDMA address of slot n (0 = P, 1 = B, 2 = P_F2, 3 = B_F2): the queued
+ * buffer sitting in that slot in zero-copy mode, the BDbuf field otherwise.
+ * A mosaic tile lands at its own place in the QF buffer (BDMA_WHP keeps
+ * width and pitch apart, so the hardware composes the mosaic itself).
+ */
+static dma_addr_t BD_addr(struct TW68_dev *dev, int nDMA_channel, int n)
+{
+	struct TW68_buf *buf = dev->video_dmaq[nDMA_channel + 1].slot[n];
+	struct TW68_tile *t = dev->tile[nDMA_channel];
+
+	if (buf)
+		return vb2_dma_contig_plane_dma_addr(&buf->vb, 0) +
+		    (t ? t->dst_off : 0);
+
+	return dev->BDbuf[nDMA_channel][n].dma_addr;
+}
+
+/*
+ * Per board pool of DMA buffers.  BD_free(), SG_field_free() and the vb2
+ * put of the DMA capture modes park what they release here, and the next
+ * allocation of the same size takes it back, so reopening a device at an
+ * unchanged format costs no allocation or IOMMU mapping.  At most pool_max
+ * buffers are kept, the oldest go first.
+ */
+struct TW68_pooled {
+	struct list_head list;
+	unsigned long size;
+	struct dma_mem mem;		/* a BDbuf frame, or */
+	struct dma_region field;	/* an SG field when field.kvirt is set */
+	const struct vb2_mem_ops *ops;	/* a vb2 capture buffer of these ops */
+	void *vb;
+	enum dma_data_direction dir;
+};
+
+/*
+ * A BDbuf frame is either uncached coherent memory or, with bd_streaming,
+ * cacheable pages mapped with the streaming DMA API.  The copy out of the
+ * latter runs at cache speed but has to be bracketed by BD_sync_for_cpu()
+ * and BD_sync_for_device().
+ */
+static int BD_map(struct TW68_dev *dev, struct dma_mem *m, unsigned int size,
+		  int streaming)
+{
+	m->size = size;
+	m->streaming = streaming;
+	if (!streaming) {
+		m->cpu = pci_alloc_consistent(dev->pci, size, &m->dma_addr);
+		return m->cpu ? 0 : -ENOMEM;
+	}
+
+	/* below 4G, or swiotlb would bounce every field */
+	m->cpu = alloc_pages_exact(size, GFP_KERNEL | __GFP_DMA32);
+	if (NULL == m->cpu)
+		return -ENOMEM;
+	m->dma_addr = pci_map_single(dev->pci, m->cpu, size,
+				     PCI_DMA_FROMDEVICE);
+	if (pci_dma_mapping_error(dev->pci, m->dma_addr)) {
+		free_pages_exact(m->cpu, size);
+		m->cpu = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void BD_unmap(struct TW68_dev *dev, struct dma_mem *m)
+{
+	if (!m->streaming) {
+		pci_free_consistent(dev->pci, m->size, m->cpu, m->dma_addr);
+	} else {
+		pci_unmap_single(dev->pci, m->dma_addr, m->size,
+				 PCI_DMA_FROMDEVICE);
+		free_pages_exact(m->cpu, m->size);
+	}
+	m->cpu = NULL;
+}
+
+static inline void BD_sync_for_cpu(struct TW68_dev *dev, struct dma_mem *m)
+{
+	if (m->streaming)
+		pci_dma_sync_single_for_cpu(dev->pci, m->dma_addr, m->size,
+					    PCI_DMA_FROMDEVICE);
+}
+
+static inline void BD_sync_for_device(struct TW68_dev *dev, struct dma_mem *m)
+{
+	if (m->streaming)
+		pci_dma_sync_single_for_device(dev->pci, m->dma_addr, m->size,
+					       PCI_DMA_FROMDEVICE);
+}
+
+/* the parked bytes a buffer counts in */
+static atomic_long_t *TW68_pool_bytes(struct TW68_dev *dev,
+				      struct TW68_pooled *p)
+{
+	return p->ops ? &dev->dma_vb : &dev->dma_pooled;
+}
+
+static void TW68_pool_release(struct TW68_dev *dev, struct TW68_pooled *p)
+{
+	atomic_long_sub(p->size, TW68_pool_bytes(dev, p));
+	if (p->ops) {
+		p->ops->put(p->vb);
+	} else if (p->field.kvirt) {
+		dma_field_free(&p->field);
+		atomic_long_sub(p->size, &dev->dma_sg);
+	} else {
+		BD_unmap(dev, &p->mem);
+		atomic_long_sub(p->size, &dev->dma_coherent);
+	}
+	kfree(p);
+}
+
+/* a driver buffer, or with ops a vb2 capture buffer mapped for dir */
+static struct TW68_pooled *TW68_pool_take(struct TW68_dev *dev,
+					  unsigned long size, int sg,
+					  const struct vb2_mem_ops *ops,
+					  enum dma_data_direction dir)
+{
+	struct TW68_pooled *p;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->pool_lock, flags);
+	list_for_each_entry(p, &dev->pool, list) {
+		if (p->size != size || p->ops != ops)
+			continue;
+		if (ops ? p->dir == dir :
+		    !!p->field.kvirt == sg &&
+		    (sg || p->mem.streaming == !!bd_streaming)) {
+			list_del(&p->list);
+			dev->pool_count--;
+			spin_unlock_irqrestore(&dev->pool_lock, flags);
+			atomic_long_sub(size, TW68_pool_bytes(dev, p));
+			return p;
+		}
+	}
+	spin_unlock_irqrestore(&dev->pool_lock, flags);
+	return NULL;
+}
+
+static void TW68_pool_park(struct TW68_dev *dev, struct TW68_pooled *p)
+{
+	struct TW68_pooled *old = NULL;
+	unsigned long flags;
+
+	atomic_long_add(p->size, TW68_pool_bytes(dev, p));
+	spin_lock_irqsave(&dev->pool_lock, flags);
+	list_add_tail(&p->list, &dev->pool);
+	if (++dev->pool_count > pool_max) {
+		old = list_first_entry(&dev->pool, struct TW68_pooled, list);
+		list_del(&old->list);
+		dev->pool_count--;
+	}
+	spin_unlock_irqrestore(&dev->pool_lock, flags);
+
+	if (old)
+		TW68_pool_release(dev, old);
+}
+
+/* bd_bench=1: copy a D1 frame out of each kind of BDbuf and log the rate */
+void TW68_bd_bench(struct TW68_dev *dev)
+{
+	static const char *const kind[] = { "coherent", "streaming" };
+	unsigned int size = PAGE_ALIGN(704 * 576 * 2);
+	struct dma_mem m;
+	void *dst;
+	ktime_t t;
+	s64 ns;
+	int mode, k;
+
+	dst = vmalloc(size);
+	if (NULL == dst)
+		return;
+
+	for (mode = 0; mode < 2; mode++) {
+		if (BD_map(dev, &m, size, mode))
+			continue;
+		memset(m.cpu, 0, size);
+		BD_sync_for_device(dev, &m);
+
+		t = ktime_get();
+		for (k = 0; k < 32; k++) {
+			BD_sync_for_cpu(dev, &m);
+			memcpy(dst, m.cpu, size);
+			BD_sync_for_device(dev, &m);
+		}
+		ns = ktime_to_ns(ktime_sub(ktime_get(), t));
+
+		printk(KERN_INFO "%s: %s frame copy %lld MB/s\n", dev->name,
+		       kind[mode], ns ? div64_s64((s64)size * 32 * 1000, ns) : 0);
+		BD_unmap(dev, &m);
+	}
+	vfree(dst);
+}
+
+static void TW68_vb_disown(struct TW68_dev *dev);
+
+/* device removal: every driver buffer is back in the pool */
+void TW68_pool_drain(struct TW68_dev *dev)
+{
+	struct TW68_pooled *p;
+	unsigned long flags;
+
+	TW68_vb_disown(dev);
+	for (;;) {
+		spin_lock_irqsave(&dev->pool_lock, flags);
+		p = list_first_entry_or_null(&dev->pool, struct TW68_pooled,
+					     list);
+		if (p) {
+			list_del(&p->list);
+			dev->pool_count--;
+		}
+		spin_unlock_irqrestore(&dev->pool_lock, flags);
+		if (NULL == p)
+			break;
+		TW68_pool_release(dev, p);
+	}
+}
+
+static int BD_get(struct TW68_dev *dev, struct dma_mem *m, unsigned int size)
+{
+	struct TW68_pooled *p = TW68_pool_take(dev, size, 0, NULL, 0);
+
+	if (p) {
+		*m = p->mem;
+		kfree(p);
+		return 0;
+	}
+	if (BD_map(dev, m, size, !!bd_streaming))
+		return -ENOMEM;
+	atomic_long_add(size, &dev->dma_coherent);
+	return 0;
+}
+
+static void BD_put(struct TW68_dev *dev, struct dma_mem *m)
+{
+	struct TW68_pooled *p = kzalloc(sizeof(*p), GFP_KERNEL);
+
+	if (p) {
+		p->size = m->size;
+		p->mem = *m;
+		TW68_pool_park(dev, p);
+	} else {
+		atomic_long_sub(m->size, &dev->dma_coherent);
+		BD_unmap(dev, m);
+	}
+	m->cpu = NULL;
+	m->dma_addr = 0;
+	m->size = 0;
+}
+
+/*
+ * vb2 capture buffers of the DMA capture modes.  The queue gets the
+ * allocator's ops with alloc and put replaced: put parks a buffer that is
+ * no longer mapped or exported instead of freeing it, alloc takes one of
+ * the same size back.  put is only given the buffer, so every buffer
+ * handed to vb2 is remembered with its board.
+ */
+struct TW68_vb_live {
+	struct list_head list;
+	void *vb;
+	struct TW68_dev *dev;		/* NULL once the board is removed */
+	unsigned long size;
+	enum dma_data_direction dir;
+};
+
+static LIST_HEAD(TW68_vb_live);
+static DEFINE_SPINLOCK(TW68_vb_lock);
+static struct vb2_mem_ops TW68_vb_contig_ops, TW68_vb_sg_ops;
+
+/* the board whose vb2 allocator context this is */
+static struct TW68_dev *TW68_vb_board(void *alloc_ctx)
+{
+	struct TW68_dev *dev, *found = NULL;
+
+	mutex_lock(&TW686v_devlist_lock);
+	list_for_each_entry(dev, &TW686v_devlist, devlist)
+		if (alloc_ctx && dev->alloc_ctx == alloc_ctx)
+			found = dev;
+	mutex_unlock(&TW686v_devlist_lock);
+	return found;
+}
+
+static void *TW68_vb_alloc(const struct vb2_mem_ops *ops, void *alloc_ctx,
+			   unsigned long size, enum dma_data_direction dir,
+			   gfp_t gfp_flags)
+{
+	struct TW68_dev *dev = TW68_vb_board(alloc_ctx);
+	struct TW68_vb_live *l;
+	struct TW68_pooled *p;
+	unsigned long flags;
+	void *vb = NULL, *va;
+
+	if (NULL == dev)
+		return ops->alloc(alloc_ctx, size, dir, gfp_flags);
+
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (NULL == l)
+		return ERR_PTR(-ENOMEM);
+
+	p = TW68_pool_take(dev, size, 0, ops, dir);
+	if (p) {
+		vb = p->vb;
+		kfree(p);
+		/* the last opener's frames must not reach the next one */
+		va = ops->vaddr(vb);
+		if (va) {
+			memset(va, 0, size);
+		} else {
+			ops->put(vb);
+			vb = NULL;
+		}
+	}
+	if (NULL == vb) {
+		vb = ops->alloc(alloc_ctx, size, dir, gfp_flags);
+		if (IS_ERR_OR_NULL(vb)) {
+			kfree(l);
+			return vb;
+		}
+	}
+
+	l->vb = vb;
+	l->dev = dev;
+	l->size = size;
+	l->dir = dir;
+	spin_lock_irqsave(&TW68_vb_lock, flags);
+	list_add(&l->list, &TW68_vb_live);
+	spin_unlock_irqrestore(&TW68_vb_lock, flags);
+	return vb;
+}
+
+static void TW68_vb_put(const struct vb2_mem_ops *ops, void *vb)
+{
+	struct TW68_vb_live *l;
+	struct TW68_pooled *p = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&TW68_vb_lock, flags);
+	list_for_each_entry(l, &TW68_vb_live, list)
+		if (l->vb == vb)
+			goto found;
+	spin_unlock_irqrestore(&TW68_vb_lock, flags);
+	ops->put(vb);
+	return;
+
+found:
+	list_del(&l->list);
+	spin_unlock_irqrestore(&TW68_vb_lock, flags);
+
+	/* still mmapped or exported: userspace would see the next stream */
+	if (l->dev && 1 == ops->num_users(vb))
+		p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (p) {
+		p->size = l->size;
+		p->ops = ops;
+		p->vb = vb;
+		p->dir = l->dir;
+		TW68_pool_park(l->dev, p);
+	} else {
+		ops->put(vb);
+	}
+	kfree(l);
+}
+
+static void *TW68_vb_contig_alloc(void *alloc_ctx, unsigned long size,
+				  enum dma_data_direction dir, gfp_t gfp_flags)
+{
+	return TW68_vb_alloc(&vb2_dma_contig_memops, alloc_ctx, size, dir,
+			     gfp_flags);
+}
+
+static void TW68_vb_contig_put(void *vb)
+{
+	TW68_vb_put(&vb2_dma_contig_memops, vb);
+}
+
+static void *TW68_vb_sg_alloc(void *alloc_ctx, unsigned long size,
+			      enum dma_data_direction dir, gfp_t gfp_flags)
+{
+	return TW68_vb_alloc(&vb2_dma_sg_memops, alloc_ctx, size, dir,
+			     gfp_flags);
+}
+
+static void TW68_vb_sg_put(void *vb)
+{
+	TW68_vb_put(&vb2_dma_sg_memops, vb);
+}
+
+/* buffers still with vb2 when the board goes are freed by their put */
+static void TW68_vb_disown(struct TW68_dev *dev)
+{
+	struct TW68_vb_live *l;
+	unsigned long flags;
+
+	spin_lock_irqsave(&TW68_vb_lock, flags);
+	list_for_each_entry(l, &TW68_vb_live, list)
+		if (l->dev == dev)
+			l->dev = NULL;
+	spin_unlock_irqrestore(&TW68_vb_lock, flags);
+}
+
+/* vb2 mem_ops of a capture mode, the copy mode keeps vmalloc buffers */
+const struct vb2_mem_ops *TW68_vb_memops(int capture_mode)
+{
+	if (capture_mode == TW68_CAPTURE_SG)
+		return &TW68_vb_sg_ops;
+	if (capture_mode == TW68_CAPTURE_CONTIG)
+		return &TW68_vb_contig_ops;
+	return &vb2_vmalloc_memops;
+}
+
+static void TW68_vb_init(void)
+{
+	TW68_vb_contig_ops = vb2_dma_contig_memops;
+	TW68_vb_contig_ops.alloc = TW68_vb_contig_alloc;
+	TW68_vb_contig_ops.put = TW68_vb_contig_put;
+	TW68_vb_sg_ops = vb2_dma_sg_memops;
+	TW68_vb_sg_ops.alloc = TW68_vb_sg_alloc;
+	TW68_vb_sg_ops.put = TW68_vb_sg_put;
+}
+
+/*
+ * BDbuf: the four coherent frames behind the BDMA slots of a channel
+ * when no capture buffer sits there, i.e. every frame in copy mode and
+ * dropped frames in zero-copy mode.  They are sized for the negotiated
+ * format and only held while the channel DMA runs.
+ */
+int BD_alloc(struct TW68_dev *dev, int nDMA_channel, unsigned int size)
+{
+	struct dma_mem *bd = dev->BDbuf[nDMA_channel];
+	int n;
+
+	size = PAGE_ALIGN(size);
+	if (bd[0].cpu) {
+		if (bd[0].size >= size)
+			return 0;
+		if (dev->videoDMA_ID & (1 << nDMA_channel))
+			return -EBUSY;	// the DMA is writing into them
+		BD_free(dev, nDMA_channel);
+	}
+
+	for (n = 0; n < 4; n++) {
+		if (BD_get(dev, &bd[n], size)) {
+			printk(KERN_ERR "%s: no memory for %u byte frames of channel %d\n",
+			       dev->name, size, nDMA_channel);
+			BD_free(dev, nDMA_channel);
+			return -ENOMEM;
+		}
+	}
+
+	for (n = 0; n < 4; n++)
+		reg_writel(BDMA_ADDR_P_0 + nDMA_channel * 8 + n * 2,
+			   BD_addr(dev, nDMA_channel, n));
+	return 0;
+}
+
+/* the channel DMA is stopped */
+void BD_free(struct TW68_dev *dev, int nDMA_channel)
+{
+	struct dma_mem *bd = dev->BDbuf[nDMA_channel];
+	int n;
+
+	for (n = 0; n < 4; n++)
+		if (bd[n].cpu)
+			BD_put(dev, &bd[n]);
+}
+
+void BFDMA_setup(struct TW68_dev *dev, int nDMA_channel, int H, int W, int P)	//    Field0   P B    Field1  P B     WidthHightPitch
+{
+	u32 regDW, dwV, dn;
+
+	reg_writel((BDMA_ADDR_P_0 + nDMA_channel * 8),
+			BD_addr(dev, nDMA_channel, 0));	//P DMA page table
+	reg_writel((BDMA_ADDR_B_0 + nDMA_channel * 8),
+		   BD_addr(dev, nDMA_channel, 1));
+	reg_writel((BDMA_WHP_0 + nDMA_channel * 8),
+		   (W & 0x7FF) | ((P & 0x7FF) << 11) | ((H & 0x3FF) << 22));
+
+	reg_writel((BDMA_ADDR_P_F2_0 + nDMA_channel * 8),
+			BD_addr(dev, nDMA_channel, 2));	//P DMA page table
+	reg_writel((BDMA_ADDR_B_F2_0 + nDMA_channel * 8),
+		   BD_addr(dev, nDMA_channel, 3));
+	TW68_F2_setup(dev, nDMA_channel);
+
+	regDW = reg_readl(PHASE_REF_CONFIG);
+	dn = (nDMA_channel << 1) + 0x10;
+// GN: USE_FIELD_MODE ?
+	dwV = (0x2 << dn);
+
+	regDW |= dwV;
+	reg_writel(PHASE_REF_CONFIG, regDW);
+	dwV = reg_readl(PHASE_REF_CONFIG);
+}
+
+/*
+ * Decoder window of a channel, in pixels and frame lines from the top
+ * left of the active picture.  It is the whole picture unless cropped
+ * through VIDIOC_S_SELECTION, or when the crop no longer fits the norm.
+ */
+void TW68_crop_window(struct TW68_dev *dev, int nId, struct v4l2_rect *r)
+{
+	int maxh = dev->PAL50[nId + 1] ? 576 : 480;
+
+	*r = dev->crop[nId];
+	if (r->width <= 0 || r->top + r->height > maxh) {
+		r->left = 0;
+		r->top = 0;
+		r->width = 720;
+		r->height = maxh;
+	}
+}
+
+/*
+ * The scalers only shrink: for a picture larger than the crop (a mosaic
+ * tile) the window grows around the crop instead.
+ */
+static void TW68_decoder_window(struct TW68_dev *dev, int nId, int nHeight,
+				int nWidth, struct v4l2_rect *r)
+{
+	int maxh = dev->PAL50[nId + 1] ? 576 : 480;
+
+	TW68_crop_window(dev, nId, r);
+	if (r->width < nWidth) {
+		r->left = clamp_t(int, r->left - (nWidth - r->width) / 2,
+				  0, 720 - nWidth) & ~1;
+		r->width = nWidth;
+	}
+	if (r->height < nHeight * 2) {
+		r->top = clamp_t(int, r->top - (nHeight * 2 - r->height) / 2,
+				 0, maxh - nHeight * 2) & ~1;
+		r->height = nHeight * 2;
+	}
+}
+
+/* window registers, CROP_H holds bits 9:8 of the other four */
+static void TW68_decoder_crop(struct TW68_dev *dev, int nId,
+			      const struct v4l2_rect *r)
+{
+	u32 nOff, vdelay, vactive, hdelay, hactive;
+
+	nOff = nId < 4 ? nId * 0x10 : (nId - 4) * 0x10 + 0x100;
+	vdelay = (dev->PAL50[nId + 1] ? 0x18 : 0x14) + r->top / 2;
+	vactive = r->height / 2;	// field lines
+	hdelay = (dev->PAL50[nId + 1] ? 0x0C : 0x0E) + r->left;
+	hactive = r->width;
+
+	reg_writel(CROP_H0 + nOff, (((vdelay >> 8) & 3) << 6) |
+		   (((vactive >> 8) & 3) << 4) | (((hdelay >> 8) & 3) << 2) |
+		   ((hactive >> 8) & 3));
+	reg_writel(VDELAY0 + nOff, vdelay & 0xFF);
+	reg_writel(VACTIVE_L0 + nOff, vactive & 0xFF);
+	reg_writel(HDELAY0 + nOff, hdelay & 0xFF);
+	reg_writel(HACTIVE_L0 + nOff, hactive & 0xFF);
+	// the F2 set has delays of its own, the sub-stream sees the same window
+	reg_writel(CROP_H0_F2 + nOff, (((vdelay >> 8) & 3) << 6) |
+		   (((vactive >> 8) & 3) << 4) | (((hdelay >> 8) & 3) << 2) |
+		   ((hactive >> 8) & 3));
+	reg_writel(VDELAY0_F2 + nOff, vdelay & 0xFF);
+	reg_writel(HDELAY0_F2 + nOff, hdelay & 0xFF);
+}
+
+/*
+ * Scale factors (source / picture, 8 fractional bits, rounded down) for
+ * nWidth x nHeight (field lines) out of window r.  Of whole lines only
+ * the 704 pixel aperture is scaled, unless the picture is wider.
+ */
+static void TW68_decoder_scale(const struct v4l2_rect *r, u32 nHeight,
+			       u32 nWidth, u32 *nH, u32 *nW)
+{
+	u32 nSrc = r->width;
+
+	if (nSrc == 720 && nWidth <= 704)
+		nSrc = 704;
+	*nW = (nSrc * 256) / (nWidth & 0x7FF);
+	*nH = (r->height / 2 * 256) / (nHeight & 0x1FF);
+}
+
+/*
+ * Part of the decoder window the scaler actually samples for an
+ * nWidth x nHeight (field lines) picture, after the rounding above.
+ */
+void TW68_scaler_window(struct TW68_dev *dev, int nId, int nHeight,
+			int nWidth, struct v4l2_rect *r)
+{
+	u32 nH, nW;
+
+	if (dev->decimate[nId]) {	// the window unscaled, see TW68_decoder_setup()
+		TW68_crop_window(dev, nId, r);
+		if (dev->decimate[nId] & TW68_DECIMATE_H)
+			nWidth *= 2;
+		r->width = nWidth;
+		return;
+	}
+	TW68_decoder_window(dev, nId, nHeight, nWidth, r);
+	TW68_decoder_scale(r, nHeight, nWidth, &nH, &nW);
+	r->width = nWidth * nW / 256;
+	r->height = nHeight * nH / 256 * 2;
+}
+
+/*
+ * Second size/scaler set of a channel (VIDEO_SIZE_REG0_F2, xSCALEx_F2,
+ * BDMA_WHP_F2).  The hardware alternates the F1 and F2 sets frame by
+ * frame.  Without a sub-stream F2 mirrors F1 and both feed the main
+ * stream; while the sub-stream node streams F2 gets its geometry and
+ * its frames go to that node.
+ */
+void TW68_F2_setup(struct TW68_dev *dev, int nDMA_channel)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[TW68_SUB_NODE + nDMA_channel];
+	u32 nAddr, nAddr2, nW, nH, nWidth, nHeight, k;
+	struct v4l2_rect r;
+
+	if (nDMA_channel < 4) {
+		nAddr = VSCALE1_LO + (nDMA_channel << 4);
+		nAddr2 = VSCALE1_LO_F2 + (nDMA_channel << 4);
+	} else {
+		nAddr = VSCALE1_LO + ((nDMA_channel - 4) << 4) + 0x100;
+		nAddr2 = VSCALE1_LO_F2 + ((nDMA_channel - 4) << 4) + 0x100;
+	}
+
+	if (!(dev->streaming & (1 << (nDMA_channel + 8))) || 0 == q->height) {
+		reg_writel(VIDEO_SIZE_REG0_F2 + nDMA_channel,
+			   reg_readl(VIDEO_SIZE_REG0 + nDMA_channel));
+		for (k = 0; k < 3; k++)		// V, VH, H
+			reg_writel(nAddr2 + k, reg_readl(nAddr + k));
+		reg_writel(BDMA_WHP_F2_0 + nDMA_channel * 8,
+			   reg_readl(BDMA_WHP_0 + nDMA_channel * 8));
+		return;
+	}
+
+	nHeight = q->height / 2;	// field lines
+	nWidth = q->width;
+	reg_writel(VIDEO_SIZE_REG0_F2 + nDMA_channel,
+		   nWidth | (nHeight << 16) | (1 << 31));
+
+	// same window and scale factors as DecoderResize()
+	TW68_decoder_window(dev, nDMA_channel, nHeight, nWidth, &r);
+	TW68_decoder_scale(&r, nHeight, nWidth, &nH, &nW);
+
+	reg_writel(nAddr2, nH & 0xFF);
+	reg_writel(nAddr2 + 1, (((nH >> 8) & 0xF) << 4) | ((nW >> 8) & 0xF));
+	reg_writel(nAddr2 + 2, nW & 0xFF);
+
+	reg_writel(BDMA_WHP_F2_0 + nDMA_channel * 8,
+		   (q->pitch & 0x7FF) | ((q->pitch & 0x7FF) << 11) |
+		   ((nHeight & 0x3FF) << 22));
+}
+
+/* queue a frame finished in the F1 (Fn = 0) or F2 set of a channel goes to */
+struct TW68_dmaqueue *TW68_frame_queue(struct TW68_dev *dev,
+				       int nDMA_channel, u32 Fn)
+{
+	struct TW68_dmaqueue *sub = &dev->video_dmaq[TW68_SUB_NODE + nDMA_channel];
+
+	if (Fn && (dev->streaming & (1 << (nDMA_channel + 8))))
+		return sub;
+	return &dev->video_dmaq[nDMA_channel + 1];
+}
+
+/*
+ * Zero-copy capture (TW68_CAPTURE_CONTIG)
+ *
+ * The four BDMA address registers of a channel are used as slots.  Each
+ * slot holds a queued dma-contig buffer, so the hardware writes the frame
+ * straight into memory userspace will dequeue.  When a slot completes the
+ * buffer is handed back and the slot is reloaded with the next queued
+ * buffer while the hardware is busy with the other one.  With nothing
+ * queued the slot falls back to the channel's BDbuf field and the frame
+ * is dropped.  Called with dev->slock held.
+ */
+static void BD_Refill(struct TW68_dev *dev, int nDMA_channel, int n)
+{
+	struct TW68_dmaqueue *q = TW68_frame_queue(dev, nDMA_channel, n >> 1);
+	struct TW68_buf *buf = NULL;
+
+	if (!list_empty(&q->queued)) {
+		buf = list_entry(q->queued.next, struct TW68_buf, queue);
+		list_del(&buf->queue);
+		buf->activate(dev, buf, NULL);
+	}
+	dev->video_dmaq[nDMA_channel + 1].slot[n] = buf;
+
+	reg_writel(BDMA_ADDR_P_0 + nDMA_channel * 8 + n * 2,
+		   BD_addr(dev, nDMA_channel, n));
+}
+
+/* fill the idle slots; the other stream of the channel may own the rest */
+void BD_Start(struct TW68_dev *dev, int nDMA_channel)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nDMA_channel + 1];
+	unsigned long flags;
+	int n;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	for (n = 0; n < 4; n++)
+		if (NULL == q->slot[n])
+			BD_Refill(dev, nDMA_channel, n);
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+/*
+ * A stream stopped: return the buffers in the given slots (bit n = slot
+ * n) and park those slots on BDbuf
+ */
+void BD_Release(struct TW68_dev *dev, int nDMA_channel, u32 slots)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nDMA_channel + 1];
+	struct TW68_buf *buf;
+	unsigned long flags;
+	int n;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	for (n = 0; n < 4; n++) {
+		if (!(slots & (1 << n)))
+			continue;
+		buf = q->slot[n];
+		q->slot[n] = NULL;
+		reg_writel(BDMA_ADDR_P_0 + nDMA_channel * 8 + n * 2,
+			   dev->BDbuf[nDMA_channel][n].dma_addr);
+		if (buf)
+			vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
+	}
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+int BD_Done(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB)
+{
+	struct TW68_buf *buf;
+	unsigned long flags;
+	int n, nId = nDMA_channel + 1;
+
+	n = 0;
+	if (Fn)
+		n = 2;
+	if (PB)
+		n++;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	buf = dev->video_dmaq[nId].slot[n];
+	BD_Refill(dev, nDMA_channel, n);
+	spin_unlock_irqrestore(&dev->slock, flags);
+
+	if (NULL == buf)
+		return 0;
+
+	buf->vb.v4l2_buf.sequence = dev->video_fieldcount[nId];
+	v4l2_get_timestamp(&buf->vb.v4l2_buf.timestamp);
+	vb2_buffer_done(&buf->vb, VB2_BUF_STATE_DONE);
+	return 1;
+}
+
+/*
+ * Zero-copy mosaic.  The tile channels run at their own pace, so each one
+ * fills its slots with the oldest QF buffer it has not written into yet,
+ * and a buffer is done once every tile has completed a frame into it.
+ * Buffers being composed wait on the QF active list.  Only tiles of the
+ * mosaic's own board get here.  Called with dev->slock held.
+ */
+static void QF_Refill(struct TW68_dev *dev, struct TW68_tile *t, int n)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[t->m->node];
+	struct TW68_buf *buf;
+	u32 bit = 1 << (t - t->m->tile);
+
+	list_for_each_entry(buf, &q->active, queue)
+		if (!(buf->qf_given & bit))
+			goto found;
+
+	buf = NULL;
+	if (!list_empty(&q->queued)) {
+		buf = list_entry(q->queued.next, struct TW68_buf, queue);
+		list_move_tail(&buf->queue, &q->active);
+		buf->qf_given = 0;
+		buf->qf_done = 0;
+		buf->activate(dev, buf, NULL);
+	}
+found:
+	if (buf)
+		buf->qf_given |= bit;
+	dev->video_dmaq[t->ch + 1].slot[n] = buf;
+
+	reg_writel(BDMA_ADDR_P_0 + t->ch * 8 + n * 2, BD_addr(dev, t->ch, n));
+}
+
+void QF_Start(struct TW68_mosaic *m)
+{
+	struct TW68_dev *dev = m->dev;
+	unsigned long flags;
+	int k, n;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	for (n = 0; n < 4; n++)
+		for (k = 0; k < m->ntiles; k++)
+			if (NULL == dev->video_dmaq[m->tile[k].ch + 1].slot[n])
+				QF_Refill(dev, &m->tile[k], n);
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+/* park every slot on BDbuf, the buffers stay on the active list */
+void QF_Release(struct TW68_mosaic *m)
+{
+	struct TW68_dev *dev = m->dev;
+	unsigned long flags;
+	int k, n, ch;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	for (k = 0; k < m->ntiles; k++)
+		for (n = 0; n < 4; n++) {
+			ch = m->tile[k].ch;
+			dev->video_dmaq[ch + 1].slot[n] = NULL;
+			reg_writel(BDMA_ADDR_P_0 + ch * 8 + n * 2,
+				   BD_addr(dev, ch, n));
+		}
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+int QF_Done(struct TW68_tile *t, int n)
+{
+	struct TW68_dev *dev = t->dev;
+	struct TW68_buf *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	buf = dev->video_dmaq[t->ch + 1].slot[n];
+	QF_Refill(dev, t, n);
+	if (buf) {
+		buf->qf_done |= 1 << (t - t->m->tile);
+		if (buf->qf_done == (1 << t->m->ntiles) - 1)
+			list_del(&buf->queue);
+		else
+			buf = NULL;
+	}
+	spin_unlock_irqrestore(&dev->slock, flags);
+
+	if (NULL == buf)
+		return 0;
+
+	buf->vb.v4l2_buf.sequence = dev->video_fieldcount[t->m->node]++;
+	v4l2_get_timestamp(&buf->vb.v4l2_buf.timestamp);
+	vb2_buffer_done(&buf->vb, VB2_BUF_STATE_DONE);
+	return 1;
+}
+
+/*
+ * Scatter-gather capture (TW68_CAPTURE_SG)
+ *
+ * Each channel owns TW68_SG_ENTRIES page table entries in the P table and
+ * the same in the B table of m_Page0.  The hardware writes the top field
+ * through the P entries and the bottom field through the B entries, so a
+ * buffer is filled as V4L2_FIELD_SEQ_TB.  Every buffer gets its own chain
+ * for both fields at prepare time; a slot change only copies the chain into
+ * the channel's table while the hardware works on the other one.
+ */
+
+/*
+ * Build the chain for bytes [offset, offset + FieldSize) of a mapped
+ * sglist.  DMA_CHx_CONFIG covers a fixed number of entries, so the largest
+ * chunks are halved until the chain is exactly count entries long.
+ */
+int SG_Chain(__le32 *desc, struct scatterlist *sglist, int sglen,
+	     unsigned int offset, unsigned int FieldSize, unsigned int count)
+{
+	struct scatterlist *sg;
+	u32 *d = (u32 *) desc;
+	u32 start, stop, end, pos, addr, len, half, dwCtrl;
+	unsigned int i, j, n;
+
+	n = 0;
+	pos = 0;
+	end = offset + FieldSize;
+
+	for_each_sg(sglist, sg, sglen, i) {
+		start = pos;
+		stop = pos + sg_dma_len(sg);
+		pos = stop;
+
+		if (stop <= offset)
+			continue;
+		if (start >= end)
+			break;
+
+		addr = sg_dma_address(sg);
+		if (start < offset) {
+			addr += offset - start;
+			start = offset;
+		}
+		if (stop > end)
+			stop = end;
+
+		while (start < stop) {
+			if (n == count)
+				return -ENOMEM;	// too fragmented
+			len = min_t(u32, stop - start, PAGE_SIZE);
+			d[2 * n] = len;
+			d[2 * n + 1] = addr;
+			n++;
+			addr += len;
+			start += len;
+		}
+	}
+
+	if (pos < end)
+		return -EINVAL;
+
+	while (n < count) {
+		for (j = 0, i = 1; i < n; i++)
+			if (d[2 * i] > d[2 * j])
+				j = i;
+		if (d[2 * j] < 8)
+			return -EINVAL;
+
+		memmove(&d[2 * j + 2], &d[2 * j], (n - j) * 8);
+		half = (d[2 * j] / 2) & ~3;
+		d[2 * j] = half;
+		d[2 * j + 2] -= half;
+		d[2 * j + 3] += half;
+		n++;
+	}
+
+	for (i = 0; i < count; i++) {
+		dwCtrl = (((DMA_STATUS_HOST_READY & 0x3) << 30) |
+			  (((i == 0) & 1) << 29) |
+			  (((count - 1) & 0xFF) << 21) |
+			  (((count - 1) > 70) << 13) |
+			  (d[2 * i] & 0x1FFF));	// size
+		desc[2 * i] = cpu_to_le32(dwCtrl);
+		desc[2 * i + 1] = cpu_to_le32(d[2 * i + 1]);
+	}
+
+	return 0;
+}
+
+void SGDMA_setup(struct TW68_dev *dev, int nDMA_channel)
+{
+	u32 regDW, dn;
+
+	regDW = reg_readl(PHASE_REF_CONFIG);
+	dn = (nDMA_channel << 1) + 0x10;
+	regDW &= ~(0x3 << dn);
+	regDW |= (DMA_MODE_SG_RT << dn);
+	reg_writel(PHASE_REF_CONFIG, regDW);
+}
+
+static void SG_Load(struct TW68_dev *dev, int nDMA_channel, u32 PB,
+		    __le32 *chain)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nDMA_channel + 1];
+	__le32 *ptr;
 
-			dwCtrl = (((DMA_STATUS_HOST_READY & 0x3) << 30) |
-				  (((i == 0) & 1) << 29) |
-				  ((m_CurrentFrameStartIdx & 0x7F) << 14) | 
-				  ((m_NextFrameStartIdx & 0xFF) << 21) | 
-				  ((pgn > 70) << 13) |	///   70
-				  (remain & 0x1FFF));	// size
+	ptr = dev->m_Page0.cpu + (2 * TW68_SG_ENTRIES * nDMA_channel);
+	if (PB)
+		ptr += 0x800;	// 2 pages distance  switch to B
 
-			*(ptr++) = cpu_to_le32(dwCtrl);
+	memcpy(ptr, chain, q->sg_count * 8);
+	wmb();
+}
 
-			*(ptr++) = cpu_to_le32(sg_dma_address(sglist) -
-					sglist->offset);	/// setup page dma address
+/* the B table always follows the buffer whose top field went through P */
+static void SG_Refill(struct TW68_dev *dev, int nDMA_channel, u32 PB)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nDMA_channel + 1];
+	struct TW68_buf *buf = NULL;
 
-			nbytes += sglist->length;
+	if (PB) {
+		q->slot[1] = q->slot[0];
+	} else {
+		if (!list_empty(&q->queued)) {
+			buf = list_entry(q->queued.next, struct TW68_buf,
+					 queue);
+			list_del(&buf->queue);
+			buf->activate(dev, buf, NULL);
 		}
+		q->slot[0] = buf;
 	}
 
-	remain = 0;		/// (nbytes + sglist->length) - FieldSize;
-	nbytes = 0;
-	sglist = Field_B->sglist;
+	buf = q->slot[PB];
+	SG_Load(dev, nDMA_channel, PB, buf ? buf->sgdesc[PB] : q->sgdrop[PB]);
+}
 
-	ptr = (pt->cpu + (2 * nIDX * nId)) + 0x800;	// 2 pages distance  switch to B
+static int SG_field_get(struct TW68_dev *dev, struct dma_region *f,
+			unsigned long size)
+{
+	struct TW68_pooled *p = TW68_pool_take(dev, size, 1, NULL, 0);
 
-	for (i = 0; i < Field_B->n_pages; i++, sglist++) {
-		// switch to B
-		if ((nbytes + sglist->length) <= FieldSize) {
-			remain = sglist->length;
-		} else {
-			remain = FieldSize - nbytes;
-		}
+	if (p) {
+		*f = p->field;
+		kfree(p);
+		return 0;
+	}
+	if (dma_field_alloc(f, size, dev->pci, PCI_DMA_BIDIRECTIONAL))
+		return -ENOMEM;
+	atomic_long_add(size, &dev->dma_sg);
+	return 0;
+}
 
-		if (remain <= 0)
-			break;
+static void SG_field_put(struct TW68_dev *dev, struct dma_region *f)
+{
+	unsigned long size = (unsigned long)f->n_pages << PAGE_SHIFT;
+	struct TW68_pooled *p = NULL;
+
+	if (f->n_dma_pages)
+		p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (p) {
+		p->size = size;
+		p->field = *f;
+		TW68_pool_park(dev, p);
+		memset(f, 0, sizeof(*f));
+	} else {
+		if (f->n_dma_pages)
+			atomic_long_sub(size, &dev->dma_sg);
+		dma_field_free(f);
+	}
+}
 
-		dwCtrl = (((DMA_STATUS_HOST_READY & 0x3) << 30) |
-			  (((i == 0) & 1) << 29) |
-			  ((m_CurrentFrameStartIdx & 0x7F) << 14) |	/// 0xFF
-			  ((m_NextFrameStartIdx & 0xFF) << 21)
-				| ((pgn > 70) << 13) | (remain & 0x1FFF));  // size
+/*
+ * Field_P/Field_B: the fields an SG channel drops into when no capture
+ * buffer is queued.  Only SG mode needs them, so they are taken when
+ * such a channel starts and given back when it stops.
+ */
+int SG_field_alloc(struct TW68_dev *dev, int nDMA_channel,
+		   unsigned long size)
+{
+	struct dma_region *P = &dev->Field_P[nDMA_channel];
+	struct dma_region *B = &dev->Field_B[nDMA_channel];
 
-		*(ptr++) = cpu_to_le32(dwCtrl);
-		/// setup page dma address
-		*(ptr++) = cpu_to_le32(sg_dma_address(sglist) - sglist->offset);
-		nbytes += sglist->length;	/// remain
+	size = PAGE_ALIGN(size);
+	if (P->n_dma_pages && B->n_dma_pages &&
+	    ((unsigned long)P->n_pages << PAGE_SHIFT) >= size)
+		return 0;
+	SG_field_free(dev, nDMA_channel);
+
+	if (SG_field_get(dev, P, size) || SG_field_get(dev, B, size)) {
+		printk(KERN_ERR "%s: no memory for the SG fields of channel %d\n",
+		       dev->name, nDMA_channel);
+		SG_field_free(dev, nDMA_channel);
+		return -ENOMEM;
 	}
+	return 0;
+}
 
+void SG_field_free(struct TW68_dev *dev, int nDMA_channel)
+{
+	SG_field_put(dev, &dev->Field_P[nDMA_channel]);
+	SG_field_put(dev, &dev->Field_B[nDMA_channel]);
 }
-#endif
-void BFDMA_setup(struct TW68_dev *dev, int nDMA_channel, int H, int W)	//    Field0   P B    Field1  P B     WidthHightPitch
+
+int SG_Start(struct TW68_dev *dev, int nDMA_channel)
 {
-	u32 regDW, dwV, dn;
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nDMA_channel + 1];
+	unsigned long flags;
+	int err;
+
+	err = SG_Chain(q->sgdrop[0], dev->Field_P[nDMA_channel].sglist,
+		       dev->Field_P[nDMA_channel].n_dma_pages, 0,
+		       q->sg_fieldsize, q->sg_count);
+	if (!err)
+		err = SG_Chain(q->sgdrop[1], dev->Field_B[nDMA_channel].sglist,
+			       dev->Field_B[nDMA_channel].n_dma_pages, 0,
+			       q->sg_fieldsize, q->sg_count);
+	if (err) {
+		printk(KERN_ERR "%s: channel %d drop fields have no SG chain (%d)\n",
+		       dev->name, nDMA_channel, err);
+		return err;
+	}
 
-	reg_writel((BDMA_ADDR_P_0 + nDMA_channel * 8),
-			dev->BDbuf[nDMA_channel][0].dma_addr);	//P DMA page table
-	reg_writel((BDMA_ADDR_B_0 + nDMA_channel * 8),
-		   dev->BDbuf[nDMA_channel][1].dma_addr);
-	reg_writel((BDMA_WHP_0 + nDMA_channel * 8),
-		   (W & 0x7FF) | ((W & 0x7FF) << 11) | ((H & 0x3FF) << 22));
+	spin_lock_irqsave(&dev->slock, flags);
+	SG_Refill(dev, nDMA_channel, 0);
+	SG_Refill(dev, nDMA_channel, 1);
+	spin_unlock_irqrestore(&dev->slock, flags);
+	return 0;
+}
 
-	reg_writel((BDMA_ADDR_P_F2_0 + nDMA_channel * 8),
-			dev->BDbuf[nDMA_channel][2].dma_addr);	//P DMA page table
-	reg_writel((BDMA_ADDR_B_F2_0 + nDMA_channel * 8),
-		   dev->BDbuf[nDMA_channel][3].dma_addr);
-	reg_writel((BDMA_WHP_F2_0 + nDMA_channel * 8),
-		   (W & 0x7FF) | ((W & 0x7FF) << 11) | ((H & 0x3FF) << 22));
+void SG_Release(struct TW68_dev *dev, int nDMA_channel)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nDMA_channel + 1];
+	struct TW68_buf *buf;
+	unsigned long flags;
+	int n;
 
-	regDW = reg_readl(PHASE_REF_CONFIG);
-	dn = (nDMA_channel << 1) + 0x10;
-// GN: USE_FIELD_MODE ?
-	dwV = (0x2 << dn);
+	spin_lock_irqsave(&dev->slock, flags);
+	if (q->slot[0] == q->slot[1])
+		q->slot[1] = NULL;
+	for (n = 0; n < 2; n++) {
+		buf = q->slot[n];
+		q->slot[n] = NULL;
+		SG_Load(dev, nDMA_channel, n, q->sgdrop[n]);
+		if (buf)
+			vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
+	}
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
 
-	regDW |= dwV;
-	reg_writel(PHASE_REF_CONFIG, regDW);
-	dwV = reg_readl(PHASE_REF_CONFIG);
+int SG_Done(struct TW68_dev *dev, int nDMA_channel, u32 PB)
+{
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nDMA_channel + 1];
+	struct TW68_buf *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	if (!PB) {
+		if (q->slot[0])
+			q->slot[0]->top_seen = 1;
+		SG_Refill(dev, nDMA_channel, 0);
+		spin_unlock_irqrestore(&dev->slock, flags);
+		return 0;
+	}
+
+	buf = q->slot[1];
+	if (buf && q->slot[0] == buf) {
+		/* lost the P interrupt, don't let B run into this buffer again */
+		q->slot[0] = NULL;
+		SG_Load(dev, nDMA_channel, 0, q->sgdrop[0]);
+	}
+	SG_Refill(dev, nDMA_channel, 1);
+	spin_unlock_irqrestore(&dev->slock, flags);
+
+	if (NULL == buf)
+		return 0;
+
+	buf->vb.v4l2_buf.sequence = dev->video_fieldcount[nDMA_channel + 1];
+	v4l2_get_timestamp(&buf->vb.v4l2_buf.timestamp);
+	vb2_buffer_done(&buf->vb, buf->top_seen ? VB2_BUF_STATE_DONE :
+			VB2_BUF_STATE_ERROR);
+	return 1;
 }
 #if 0
 int Field_Copy(struct TW68_dev *dev, int nDMA_channel, int field_PB)
@@ -719,10 +1892,10 @@ int Field_Copy(struct TW68_dev *dev, int nDMA_channel, int field_PB)
 
 	if (q->curr) {
 		buf = q->curr;
-		vbuf = videobuf_to_vmalloc(&buf->vb);
+		vbuf = vb2_plane_vaddr(&buf->vb, 0);
 
-		Hmax = buf->vb.height / 2;
-		Wmax = buf->vb.width;
+		Hmax = buf->height / 2;
+		Wmax = buf->width;
 
 		pitch = Wmax * buf->fmt->depth / 8;
 		pos = pitch * (field_PB);
@@ -738,18 +1911,22 @@ int Field_Copy(struct TW68_dev *dev, int nDMA_channel, int field_PB)
 	return 1;
 }
 #endif
-int BF_Copy(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB)
+/*
+ * frame in BDbuf slot (Fn, PB) into the current buffer: the whole frame,
+ * with field TOP/BOTTOM only its even/odd lines, with NONE deinterlaced
+ */
+int BF_Copy(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB,
+	    enum v4l2_field field)
 {
 	struct TW68_dmaqueue *q;
 	struct TW68_buf *buf = NULL;	//,*next = NULL;
-	int n, Hmax, Wmax, pos, pitch;
-	int nId = nDMA_channel + 1;
+	struct TW68_format *fmt;
+	int n, lines, pitch, spitch;
 
 	void *vbuf, *srcbuf;	// = videobuf_to_vmalloc(&buf->vb);
 
 
 	// fill P field half frame SG mapping entries
-	pos = 0;
 	n = 0;
 
 	if (Fn)
@@ -760,79 +1937,64 @@ int BF_Copy(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB)
 
 	srcbuf = dev->BDbuf[nDMA_channel][n].cpu;
 
-	q = &dev->video_dmaq[nId];	///  &dev->video_q;
+	q = TW68_frame_queue(dev, nDMA_channel, Fn);
 
-	if (q->curr) {
+	if (q->curr && srcbuf) {
 		buf = q->curr;
-		vbuf = videobuf_to_vmalloc(&buf->vb);
-
-		Hmax = buf->vb.height / 2;
-		Wmax = buf->vb.width;
-
-		pitch = Wmax * buf->fmt->depth / 8;
-
-		if (Fn)
-			pos = pitch;
+		fmt = buf->fmt;
+		vbuf = vb2_plane_vaddr(&buf->vb, 0);
+
+		lines = buf->height;
+		pitch = buf->width * fmt->depth / 8;
+		spitch = TW68_dma_pitch(fmt, buf->width);
+		if (field == V4L2_FIELD_TOP || field == V4L2_FIELD_BOTTOM) {
+			if (field == V4L2_FIELD_BOTTOM)
+				srcbuf += spitch;
+			spitch *= 2;
+		}
 
-		memcpy(vbuf, srcbuf, Hmax * 2 * pitch);	//Test the top half frame
+		BD_sync_for_cpu(dev, &dev->BDbuf[nDMA_channel][n]);
+		if (fmt->fourcc == V4L2_PIX_FMT_GREY)
+			TW68_copy_yuyv_grey(vbuf, srcbuf, buf->width, lines,
+					    spitch);
+		else if (fmt->convert)
+			TW68_copy_yuyv_420(vbuf, srcbuf, buf->width, lines,
+					   spitch, fmt->fourcc == V4L2_PIX_FMT_NV12);
+		else if (field == V4L2_FIELD_NONE)
+			TW68_copy_deinterlace(vbuf, srcbuf, pitch, lines,
+					      dev->video_param[nDMA_channel + 1].ctl_deinterlace);
+		else if (spitch == pitch)
+			TW68_copy_frame(vbuf, srcbuf, lines * pitch);
+		else
+			TW68_copy_rows(vbuf, pitch, srcbuf, spitch, pitch, lines);
+		BD_sync_for_device(dev, &dev->BDbuf[nDMA_channel][n]);
 	} else {
 		return 0;
 	}
 	return 1;
 }
 
-int QF_Field_Copy(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB)
+/* copy frame n of a tile channel into its place in the QF buffer */
+int QF_Tile_Copy(struct TW68_tile *t, int n)
 {
-	struct TW68_dmaqueue *q;
-	struct TW68_buf *buf = NULL;
-	int Hmax, Wmax, h, n, pos, pitch, stride;
-	int nId = 0;
-
-	void *vbuf, *srcbuf;	// = videobuf_to_vmalloc(&buf->vb);
-
-	n = 0;
-	if (Fn)
-		n = 2;
-	if (PB)
-		n++;
-
-	srcbuf = dev->BDbuf[nDMA_channel][n].cpu;
-
-	q = (&dev->video_dmaq[nId]);	///  &dev->video_q; (unsigned long)
+	struct TW68_dmaqueue *q = &t->dev->video_dmaq[t->m->node];
+	struct TW68_dev *dev = t->src;
+	struct dma_mem *bd = &dev->BDbuf[t->ch][n];
 
-	if (q->curr) {
-		buf = q->curr;
-		Hmax = buf->vb.height / 2;
-		Wmax = buf->vb.width / 2;
-
-		pitch = 2 * Wmax * buf->fmt->depth / 8;
-		stride = pitch / 2;
-
-		if (nDMA_channel == 0)
-			pos = 0;
-		if (nDMA_channel == 1)
-			pos += stride;
-		if (nDMA_channel == 2)
-			pos += pitch * Hmax;
-		if (nDMA_channel == 3)
-			pos += pitch * Hmax + stride;
-
-		vbuf = videobuf_to_vmalloc(&buf->vb);
-
-		for (h = 0; h < Hmax - 0; h++) {
-			memcpy(vbuf + pos, srcbuf, stride);
-			pos += pitch;
-			srcbuf += stride;
-		}
-	} else {
+	if (NULL == q->curr || NULL == bd->cpu)
 		return 0;
-	}
+
+	BD_sync_for_cpu(dev, bd);
+	TW68_copy_rows(vb2_plane_vaddr(&q->curr->vb, 0) + t->dst_off, q->pitch,
+		       bd->cpu, t->pitch, t->wbytes, t->height);
+	BD_sync_for_device(dev, bd);
 	return 1;
 }
 
 void DecoderResize(struct TW68_dev *dev, int nId, int nHeight, int nWidth)
 {
-	u32 nAddr, nHW, nH, nW, nVal, nReg, regDW;
+	u32 nAddr, nHW, nH, nW, nVal, nReg;
+	struct v4l2_rect r;
 
 	if (nId >= 8) {
 		return;
@@ -842,53 +2004,8 @@ void DecoderResize(struct TW68_dev *dev, int nId, int nHeight, int nWidth)
 	nReg = 0xe7;		//  blue back color
 	reg_writel(MISC_CONTROL2, nReg);
 
-	if (dev->PAL50[nId + 1]) {
-		//VDelay
-		regDW = 0x18;
-		if (nId < 4) {
-			nAddr = VDELAY0 + (nId * 0x10);
-			reg_writel(nAddr, regDW);
-
-		} else {
-			nAddr = VDELAY0 + ((nId - 4) * 0x10) + 0x100;
-			reg_writel(nAddr, regDW);
-		}
-
-		//HDelay
-		regDW = 0x0A;
-		regDW = 0x0C;
-
-		if (nId < 4) {
-			nAddr = HDELAY0 + (nId * 0x10);
-			reg_writel(nAddr, regDW);
-		} else {
-			nAddr = HDELAY0 + ((nId - 4) * 0x10) + 0x100;
-			reg_writel(nAddr, regDW);
-		}
-	} else {
-		//VDelay
-		regDW = 0x14;
-		if (nId < 4) {
-			nAddr = VDELAY0 + (nId * 0x10);
-			reg_writel(nAddr, regDW);
-
-		} else {
-			nAddr = VDELAY0 + ((nId - 4) * 0x10) + 0x100;
-			reg_writel(nAddr, regDW);
-		}
-
-		//HDelay
-		regDW = 0x0D;
-		regDW = 0x0E;
-
-		if (nId < 4) {
-			nAddr = HDELAY0 + (nId * 0x10);
-			reg_writel(nAddr, regDW);
-		} else {
-			nAddr = HDELAY0 + ((nId - 4) * 0x10) + 0x100;
-			reg_writel(nAddr, regDW);
-		}
-	}
+	TW68_decoder_window(dev, nId, nHeight, nWidth, &r);
+	TW68_decoder_crop(dev, nId, &r);
 
 	nVal = reg_readl(HDELAY0 + nId);
 
@@ -899,26 +2016,8 @@ void DecoderResize(struct TW68_dev *dev, int nId, int nHeight, int nWidth)
 	reg_writel(VIDEO_SIZE_REG, nHW);	//for Rev.A backward compatible
 	reg_writel(VIDEO_SIZE_REG0 + nId, nHW);	//for Rev.B or later only
 
-	if (((nHeight == 240) || (nHeight == 288)) && (nWidth >= 700))
-		nWidth = 720;
-
-	if (((nHeight == 240) || (nHeight == 288)) && (nWidth > 699))
-		nWidth = 720;
-	else
-		nWidth = (16 * nWidth / 720) + nWidth;
-
 	//decoder  Scale 
-	nW = nWidth & 0x7FF;
-	nW = (720 * 256) / nW;
-	nH = nHeight & 0x1FF;
-
-	///if (nHeight >240)   //PAL
-	if (dev->PAL50[nId + 1]) {
-		nH = (288 * 256) / nH;
-	} else			//NTSC
-	{
-		nH = (240 * 256) / nH;
-	}
+	TW68_decoder_scale(&r, nHeight, nWidth, &nH, &nW);
 
 	if (nId >= 4) {
 		nAddr = VSCALE1_LO + ((nId - 4) << 4) + 0x100;
@@ -958,13 +2057,65 @@ void DecoderResize(struct TW68_dev *dev, int nId, int nHeight, int nWidth)
 	reg_writel(nAddr, nVal);
 	nReg = reg_readl(nAddr);
 
-// H Scaler
+// H Scaler, programmed for the widened line as before
+	if (((nHeight == 240) || (nHeight == 288)) && (nWidth > 699))
+		nWidth = 720;
+	else
+		nWidth = (16 * nWidth / 720) + nWidth;
 	nVal = (nWidth - 12 - 4) * (1 << 16) / nWidth;
 	nVal = (4 & 0x1F) | (((nWidth - 12) & 0x3FF) << 5) | (nVal << 15);
 
 	reg_writel(SHSCALER_REG0 + nId, nVal);
 }
 
+/*
+ * A picture width the decoder delivers unscaled: the window, or of the
+ * whole line the 704 pixel aperture TW68_decoder_scale() uses.
+ */
+static int TW68_unscaled_width(const struct v4l2_rect *r, int nWidth)
+{
+	return nWidth == r->width || (r->width == 720 && nWidth == 704);
+}
+
+/*
+ * Decoder setup of a channel for an nWidth x nHeight (field lines)
+ * picture.  When the picture is half the window across and/or down (and
+ * full size otherwise) the decoder runs unscaled and the channel DMA
+ * drops every other pixel or line (DMA_CH0_CONFIG bits 23/24), skipping
+ * the scaler.  Across, the window of a whole line may be its 704 pixel
+ * aperture, so CIF 352 is decimated from 704 like D1 704 is scaled.
+ * Returns the TW68_DECIMATE_x bits for the channel config.
+ */
+u32 TW68_decoder_setup(struct TW68_dev *dev, int nId, int nHeight, int nWidth)
+{
+	struct v4l2_rect r;
+	u32 dec = 0;
+
+	TW68_crop_window(dev, nId, &r);
+	if (decimate && (TW68_unscaled_width(&r, nWidth) ||
+			 TW68_unscaled_width(&r, nWidth * 2)) &&
+	    (nHeight * 2 == r.height || nHeight * 4 == r.height)) {
+		if (!TW68_unscaled_width(&r, nWidth))
+			dec |= TW68_DECIMATE_H;
+		if (nHeight * 4 == r.height)
+			dec |= TW68_DECIMATE_V;
+	}
+	dev->decimate[nId] = dec;
+
+	if (!dec) {
+		DecoderResize(dev, nId, nHeight, nWidth);
+		return 0;
+	}
+
+	DecoderResize(dev, nId, r.height / 2,
+		      dec & TW68_DECIMATE_H ? nWidth * 2 : nWidth);
+	// a custom video size (bit 31) overrides the decimation, only the
+	// per channel register: VIDEO_SIZE_REG is shared by all on Rev.A
+	reg_writel(VIDEO_SIZE_REG0 + nId,
+		   reg_readl(VIDEO_SIZE_REG0 + nId) & ~(1 << 31));
+	return dec;
+}
+
 void resync(unsigned long data)
 {
 	struct TW68_dev *dev = (struct TW68_dev *)data;
@@ -1017,10 +2168,37 @@ void TW68_buffer_timeout(unsigned long data)
 
 		dwRegE = reg_readl(DMA_CHANNEL_ENABLE);
 		dwRegF = reg_readl(DMA_CMD);
+	}
+	TW68_buffer_finish(dev, q, VB2_BUF_STATE_ERROR);
+}
+
+/*
+ * DROP_FIELD_REG: bit 31 selects the register, bits 0-29 (0-24 on 50 Hz
+ * inputs) mark the frames of each second that are DMA'd.  Dropped frames
+ * never reach the bus and never raise an interrupt.  n frames per second
+ * are spread evenly; 0 or the full rate gives the 0xBFFFFFFF default.
+ */
+void tw68v_set_framerate(struct TW68_dev *dev, u32 ch, u32 n)
+{
+	u32 k, max, pattern;
+	unsigned int pal;
+
+	if (dev->tile[ch])
+		pal = dev->tile[ch]->m->pal;	// mosaic view
+	else
+		pal = dev->PAL50[ch + 1];
+	max = pal ? 25 : 30;
 
-		TW68_buffer_finish(dev, q, VIDEOBUF_ERROR);
+	if (n == 0 || n >= max) {
+		pattern = 0xBFFFFFFF;
+	} else {
+		pattern = 1u << 31;
+		for (k = 0; k < max; k++)
+			if ((k + 1) * n / max != k * n / max)
+				pattern |= 1 << k;
 	}
-	TW68_buffer_next(dev, q);
+
+	reg_writel(DROP_FIELD_REG0 + ch, pattern);
 }
 
 int TW68_set_dmabits(struct TW68_dev *dev, unsigned int DMA_nCH)
@@ -1058,9 +2236,71 @@ int TW68_set_dmabits(struct TW68_dev *dev, unsigned int DMA_nCH)
 	dwRegF = (1 << 31);
 	dwRegF |= dwRegE;
 	reg_writel(DMA_CMD, dwRegF);
+	TW68_irq_moderate(dev);
 	return 0;
 }
 
+/*
+ * Pick the DMA_INT_REF ceiling for the channels now running.  With
+ * irq_coalesce=0 the chip interrupts about once per field as it always
+ * did.  Otherwise one interrupt may serve several channels: the window
+ * grows with the number of running channels but stays below half a 60 Hz
+ * field, so the P/B double buffer cannot overrun, and below irq_latency.
+ */
+void TW68_irq_moderate(struct TW68_dev *dev)
+{
+	u32 n, ref = TW68_INT_REF_LOWLAT;
+	unsigned long flags;
+
+	n = hweight8(dev->videoDMA_ID & 0xFF);
+	if (irq_coalesce && n > 1) {
+		ref = TW68_INT_REF_HZ / 120 / n * (n - 1);
+		ref = min_t(u32, ref, irq_latency * (TW68_INT_REF_HZ / 1000000));
+		ref = max_t(u32, ref, TW68_INT_REF_LOWLAT);
+	}
+
+	/* TW68_irq_coalesced() updates the same state in the interrupt */
+	spin_lock_irqsave(&dev->slock, flags);
+	dev->int_ref_max = ref;
+	if (!irq_coalesce || dev->int_ref > ref || !dev->int_ref)
+		dev->int_ref = ref;
+	dev->irq_lastPB = reg_readl(DMA_PB_STATUS);
+	dev->irq_calm = 0;
+	reg_writel(DMA_INT_REF, dev->int_ref);
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+/*
+ * irq_coalesce=1: every running channel whose P/B bit changed since the
+ * last interrupt has finished a field, whether or not it raised this one.
+ * A channel reporting done with an unchanged P/B bit finished two fields
+ * inside one window, so the window is halved; it creeps back towards
+ * int_ref_max while no field is lost.  Called with dev->slock held.
+ */
+static u32 TW68_irq_coalesced(struct TW68_dev *dev, u32 dwRegST, u32 dwRegPB)
+{
+	u32 run = dev->videoDMA_ID & 0xFF;
+	u32 flipped = (dwRegPB ^ dev->irq_lastPB) & run;
+	u32 ref = dev->int_ref;
+
+	dev->irq_lastPB = dwRegPB;
+
+	if (dwRegST & run & ~flipped) {
+		ref = max_t(u32, ref / 2, TW68_INT_REF_LOWLAT);
+		dev->irq_calm = 0;
+	} else if (++dev->irq_calm >= 256) {
+		ref = min_t(u32, ref + ref / 8, dev->int_ref_max);
+		dev->irq_calm = 0;
+	}
+
+	if (ref != dev->int_ref) {
+		dev->int_ref = ref;
+		reg_writel(DMA_INT_REF, ref);
+	}
+
+	return (dwRegST & ~0xFF) | flipped | (dwRegST & run);
+}
+
 int stop_video_DMA(struct TW68_dev *dev, unsigned int DMA_nCH)
 {
 	u32 dwRegER, dwRegPB, dwRegE, dwRegF, nId;
@@ -1087,6 +2327,7 @@ int stop_video_DMA(struct TW68_dev *dev, unsigned int DMA_nCH)
 		reg_writel(DMA_CMD, 0);
 		reg_writel(DMA_CHANNEL_ENABLE, 0);
 	}
+	TW68_irq_moderate(dev);
 
 	return 0;
 }
@@ -1116,27 +2357,52 @@ int VideoDecoderDetect(struct TW68_dev *dev, unsigned int DMA_nCH)
 	}
 }
 
-void video_tasklet(unsigned long device)
+/* hard irq side of TW68_event_ring; never blocks, drops on overflow */
+static void TW68_event_push(struct TW68_dev *dev, int nId, u32 dwRegPB)
 {
-	u32 dwRegST, dwRegPB, k;
-	struct TW68_dev *dev = (struct TW68_dev *)device;
+	struct TW68_dmaqueue *q = &dev->video_dmaq[nId];
+	struct TW68_event_ring *r = &q->ring;
+	unsigned int head = r->head;
 
-	dwRegST = dev->dwRegST;
-	dwRegPB = dev->dwRegPB;
+	if (head - ACCESS_ONCE(r->tail) >= TW68_EVENT_RING) {
+		r->lost++;
+		return;
+	}
+	r->dwRegPB[head & (TW68_EVENT_RING - 1)] = dwRegPB;
+	smp_wmb();		/* event before head */
+	ACCESS_ONCE(r->head) = head + 1;
 
-	for (k = 0; k < 8; k++) {
-		if ((dwRegST & dev->videoDMA_ID) & (1 << k))	/// exclude  inactive dev
-		{
-			TW68_irq_video_done(dev, k + 1, dwRegPB);
-
-			if (dev->video_dmaq[k + 1].FieldPB & 0xF0) {
-				dev->video_dmaq[k + 1].FieldPB &= 0xFFFF0000;
-			} else {
-				dev->video_dmaq[k + 1].FieldPB &= 0xFFFF00FF;	// clear  PB
-				dev->video_dmaq[k + 1].FieldPB |=
-				    (dwRegPB & (1 << k)) << 8;
-				dev->video_dmaq[k + 1].FCN++;
-			}
+	queue_work(dev->vid_wq, &q->work);
+}
+
+/*
+ * Bottom half of one DMA channel.  Each channel has its own work item,
+ * so the copies and buffer completions of different channels run on
+ * different CPUs; a single item never runs concurrently with itself.
+ */
+static void TW68_video_work(struct work_struct *work)
+{
+	struct TW68_dmaqueue *q = container_of(work, struct TW68_dmaqueue, work);
+	struct TW68_dev *dev = q->dev;
+	struct TW68_event_ring *r = &q->ring;
+	unsigned int tail = r->tail;
+	int k = q - dev->video_dmaq - 1;	// DMA channel
+	u32 dwRegPB;
+
+	while (tail != ACCESS_ONCE(r->head)) {
+		smp_rmb();	/* head before event */
+		dwRegPB = r->dwRegPB[tail & (TW68_EVENT_RING - 1)];
+		smp_mb();	/* event read before the slot is handed back */
+		ACCESS_ONCE(r->tail) = ++tail;
+
+		TW68_irq_video_done(dev, k + 1, dwRegPB);
+
+		if (q->FieldPB & 0xF0) {
+			q->FieldPB &= 0xFFFF0000;
+		} else {
+			q->FieldPB &= 0xFFFF00FF;	// clear  PB
+			q->FieldPB |= (dwRegPB & (1 << k)) << 8;
+			q->FCN++;
 		}
 	}
 }
@@ -1145,7 +2411,7 @@ static irqreturn_t TW68_irq(int irq, void *dev_id)	/// hardware dev id for the I
 {
 	struct TW68_dev *dev = (struct TW68_dev *)dev_id;
 	unsigned long flags, k, eno, handled;
-	u32 dwRegST, dwRegER, dwRegPB, dwRegE, dwRegF, dwRegVP, dwErrBit;
+	u32 dwRegST, dwRegER, dwRegPB, dwRegE, dwRegF, dwRegVP, dwErrBit, dwDone;
 	static u32 lastPB = 0;
 
 	handled = 1;
@@ -1217,12 +2483,19 @@ static irqreturn_t TW68_irq(int irq, void *dev_id)	/// hardware dev id for the I
 				TW68_alsa_irq(dev, dwRegST, dwRegPB);
 			}
 
+			dwDone = dwRegST;
+			if (irq_coalesce) {
+				spin_lock_irqsave(&dev->slock, flags);
+				dwDone = TW68_irq_coalesced(dev, dwRegST, dwRegPB);
+				spin_unlock_irqrestore(&dev->slock, flags);
+			}
+
 			// lastPB is always 0 ?!
-			if ((lastPB != dwRegPB) && (dwRegST & (0xFF)) &&
+			if ((lastPB != dwRegPB) && (dwDone & (0xFF)) &&
 					(!(dwRegER & DMA_FIFO_ANYERR_MASK))) {
-				dev->dwRegPB = dwRegPB;
-				dev->dwRegST = dwRegST;
-				tasklet_schedule(&dev->vid_tasklet);
+				for (k = 0; k < 8; k++)
+					if ((dwDone & dev->videoDMA_ID) & (1 << k))	/// exclude  inactive dev
+						TW68_event_push(dev, k + 1, dwRegPB);
 			}
 
 			if (dev->videoRS_ID) {
@@ -1281,7 +2554,7 @@ static int TW68_hwinit1(struct TW68_dev *dev)
 	pci_write_config_dword(dev->pci, PCI_COMMAND, regDW);
 
 
-	// MSI CAP     disable MSI
+	// MSI CAP     disable MSI, TW68_initdev() turns it on through the PCI core
 	pci_read_config_dword(dev->pci, 0x50, &regDW);
 	regDW &= 0xfffeffff;
 	pci_write_config_dword(dev->pci, 0x50, regDW);
@@ -1323,22 +2596,7 @@ static int TW68_hwinit1(struct TW68_dev *dev)
 	videoDMA_pgtable_alloc(dev->pci, &dev->m_Page0);
 	AudioDMA_PB_alloc(dev->pci, &dev->m_AudioBuffer);
 
-	for (k = 0; k < 8; k++) {
-		if (dma_field_alloc
-		    (&dev->Field_P[k], 720 * 600 * 2, dev->pci,
-		     PCI_DMA_BIDIRECTIONAL))
-		{
-			dma_field_free(&dev->Field_P[k]);
-			return -1;
-		}
-		if (dma_field_alloc
-		    (&dev->Field_B[k], 720 * 600 * 2, dev->pci,
-		     PCI_DMA_BIDIRECTIONAL))
-		{
-			dma_field_free(&dev->Field_B[k]);
-			return -1;
-		}
-	}
+	/* Field_P/Field_B are allocated by SG_field_alloc() when needed */
 
 	ChannelOffset = pgn = 128;	///125;
 	pgn = 85;		///   starting for 720 * 240 * 2
@@ -1392,7 +2650,8 @@ static int TW68_hwinit1(struct TW68_dev *dev)
 	reg_writel(DMA_CMD, 0);	// u32
 	reg_writel(DMA_CHANNEL_ENABLE, 0);
 	reg_writel(DMA_CHANNEL_TIMEOUT, 0x3EFF0FF0);	// longer timeout setting
-	reg_writel(DMA_INT_REF, 0x38000);	///   2a000 2b000 2c000  3932e     0x3032e
+	dev->int_ref = TW68_INT_REF_LOWLAT;
+	reg_writel(DMA_INT_REF, dev->int_ref);	///   2a000 2b000 2c000  3932e     0x3032e
 	reg_writel(DMA_CONFIG, 0x00FF0004);
 	regDW = (0xFF << 16) | (VIDEO_GEN_PATTERNS << 8) | VIDEO_GEN;
 	reg_writel(VIDEO_CTRL2, regDW);
@@ -1442,13 +2701,24 @@ static int TW68_hwfini(struct TW68_dev *dev)
 static int vdev_init(struct TW68_dev *dev, struct video_device *template,
 		     char *type)
 {
-	struct video_device *vfdev[9];	/// QF 0 + 8
+	struct video_device *vfdev[TW68_NODES];	/// QF 0 + 8 + 8 sub
 
-	int k = 1;
+	int i, k = 1;
 	int err0;
 
-	for (k = 1; k < 9; k++)	// dev0  QF muxer  dev 1 ~ 4
+	/* the QF muxes (dev0, then QF2) come last so the channel nodes keep their numbers */
+	for (i = 1; i <= TW68_NODES; i++)
 	{
+		k = i;
+		if (i == TW68_QF2_NODE)
+			k = 0;
+		else if (i == TW68_NODES)
+			k = TW68_QF2_NODE;
+		/* the page table DMA has no F2 path, so no sub-streams there */
+		if (k >= TW68_SUB_NODE && k < TW68_QF2_NODE &&
+		    dev->capture_mode == TW68_CAPTURE_SG)
+			continue;
+
 		vfdev[k] = video_device_alloc();
 
 		if (NULL == vfdev[k]) {
@@ -1463,7 +2733,10 @@ static int vdev_init(struct TW68_dev *dev, struct video_device *template,
 		vfdev[k]->release = video_device_release;
 		//vfdev[k]->debug = video_debug;
 		snprintf(vfdev[k]->name, sizeof(vfdev[k]->name), "%s %s (%s22)",
-			 dev->name, type, TW68_boards[dev->board].name);
+			 dev->name, k == TW68_QF2_NODE ? "mosaic view 2" :
+			 k >= TW68_SUB_NODE ? "sub-stream" :
+			 k ? type : "mosaic view",
+			 TW68_boards[dev->board].name);
 
 		dev->video_device[k] = vfdev[k];
 
@@ -1481,7 +2754,7 @@ static void TW68_unregister_video(struct TW68_dev *dev)
 {
 	int k;
 
-	for (k = 1; k < 9; k++)	/// 0 + 4
+	for (k = 0; k < TW68_NODES; k++)	/// 0 + 4
 	{
 		if (dev->video_device[k])
 			if (-1 != dev->video_device[k]->minor) {
@@ -1494,11 +2767,31 @@ static void TW68_unregister_video(struct TW68_dev *dev)
 	}
 }
 
+/*
+ * DMA memory the board holds: BDbuf bytes, SG field bytes, of these
+ * pooled, and vb2 capture buffer bytes parked in the pool
+ */
+static ssize_t dma_memory_show(struct device *d,
+			       struct device_attribute *attr, char *buf)
+{
+	struct v4l2_device *v4l2_dev = dev_get_drvdata(d);
+	struct TW68_dev *dev =
+	    container_of(v4l2_dev, struct TW68_dev, v4l2_dev);
+
+	return sprintf(buf, "%ld %ld %ld %ld\n",
+		       atomic_long_read(&dev->dma_coherent),
+		       atomic_long_read(&dev->dma_sg),
+		       atomic_long_read(&dev->dma_pooled),
+		       atomic_long_read(&dev->dma_vb));
+}
+
+static DEVICE_ATTR(dma_memory, S_IRUGO, dma_memory_show, NULL);
+
 static int TW68_initdev(struct pci_dev *pci_dev,
 			const struct pci_device_id *pci_id)
 {
 	struct TW68_dev *dev;
-	int err, err0;
+	int err, err0, k;
 
 	if (TW68_devcount == TW68_MAXBOARDS)
 		return -ENOMEM;
@@ -1600,21 +2893,54 @@ static int TW68_initdev(struct pci_dev *pci_dev,
 
 	TW68_hwinit1(dev);
 
-	/* get irq */
-	err = request_irq(pci_dev->irq, TW68_irq, IRQF_SHARED, dev->name, dev);
-
-	//kb: added for video tasklet;
-	tasklet_init(&dev->vid_tasklet, video_tasklet, (unsigned long)dev);
+	/* per channel bottom halves, unbound so they spread over the CPUs */
+	mutex_init(&dev->qf_lock);
+	TW68_mosaic_init(dev);
+	INIT_LIST_HEAD(&dev->pool);
+	spin_lock_init(&dev->pool_lock);
+	dev->vid_wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_HIGHPRI, 8,
+				      dev->name);
+	if (NULL == dev->vid_wq) {
+		err = -ENOMEM;
+		printk(KERN_ERR "%s: can't create video workqueue\n", dev->name);
+		goto fail3;
+	}
+	for (k = 1; k < 9; k++)
+		INIT_WORK(&dev->video_dmaq[k].work, TW68_video_work);
+
+	/* get irq, an MSI vector is ours alone and needs no IRQF_SHARED */
+	dev->msi = 0;
+	if (msi) {
+		if (pci_enable_msi(pci_dev) == 0)
+			dev->msi = 1;
+		else
+			printk(KERN_INFO "%s: MSI not available, using INTx\n",
+			       dev->name);
+	}
+	err = request_irq(pci_dev->irq, TW68_irq,
+			  dev->msi ? 0 : IRQF_SHARED, dev->name, dev);
 
 	if (err < 0) {
 		printk(KERN_ERR "%s: can't get IRQ %d\n",
 		       dev->name, pci_dev->irq);
-		goto fail3;
+		if (dev->msi)
+			pci_disable_msi(pci_dev);
+		goto fail3a;
 	}
 
+	if (irq_cpu[dev->nr] >= 0 && irq_cpu[dev->nr] < nr_cpu_ids &&
+	    cpu_online(irq_cpu[dev->nr]))
+		irq_set_affinity_hint(pci_dev->irq,
+				      cpumask_of(irq_cpu[dev->nr]));
+
+	printk(KERN_INFO "%s: irq %d (%s)\n", dev->name, pci_dev->irq,
+	       dev->msi ? "MSI" : "INTx shared");
+
 	v4l2_prio_init(&dev->prio);
 
+	mutex_lock(&TW686v_devlist_lock);
 	list_add_tail(&dev->devlist, &TW686v_devlist);
+	mutex_unlock(&TW686v_devlist_lock);
 
 	/* register v4l devices */
 	err0 = vdev_init(dev, &TW68_video_template, "video");
@@ -1631,13 +2957,32 @@ static int TW68_initdev(struct pci_dev *pci_dev,
 
 	err0 = TW68_alsa_create(dev);
 
+	if (device_create_file(&pci_dev->dev, &dev_attr_dma_memory))
+		printk(KERN_INFO "%s: no dma_memory attribute\n", dev->name);
+	if (TW68_mosaic_sysfs_add(dev))
+		printk(KERN_INFO "%s: no mosaic attributes\n", dev->name);
+
+	if (bd_bench) {
+		TW68_bd_bench(dev);
+		TW68_copy_bench(dev);
+	}
+
 	return 0;
 
 fail4:
+	mutex_lock(&TW686v_devlist_lock);
+	list_del(&dev->devlist);
+	mutex_unlock(&TW686v_devlist_lock);
 	TW68_unregister_video(dev);
+	irq_set_affinity_hint(pci_dev->irq, NULL);
 	free_irq(pci_dev->irq, dev);
+	if (dev->msi)
+		pci_disable_msi(pci_dev);
+fail3a:
+	destroy_workqueue(dev->vid_wq);
 fail3:
 	TW68_hwfini(dev);
+	TW68_video_fini1(dev);
 	iounmap(dev->lmmio);
 fail2:
 	release_mem_region(pci_resource_start(pci_dev, 0),
@@ -1652,7 +2997,7 @@ fail0:
 static void TW68_finidev(struct pci_dev *pci_dev)
 {
 
-	int m, n, k = 0;
+	int n, k = 0;
 	struct v4l2_device *v4l2_dev = pci_get_drvdata(pci_dev);
 	struct TW68_dev *dev =
 	    container_of(v4l2_dev, struct TW68_dev, v4l2_dev);
@@ -1660,15 +3005,21 @@ static void TW68_finidev(struct pci_dev *pci_dev)
 	printk(KERN_INFO "%s: Starting unregister video device %d\n",
 	       dev->name, dev->video_device[1]->num);
 
+	device_remove_file(&pci_dev->dev, &dev_attr_dma_memory);
+	TW68_mosaic_sysfs_remove(dev);
+
+	/* no mosaic finds this board any more, then drop the tiles it feeds */
+	mutex_lock(&TW686v_devlist_lock);
+	list_del(&dev->devlist);
+	mutex_unlock(&TW686v_devlist_lock);
+	TW68_mosaic_board_gone(dev);
+
 	/* shutdown hardware */
 	TW68_hwfini(dev);
 
 	/* shutdown subsystems */
 
 	/* unregister */
-	mutex_lock(&TW68_devlist_lock);
-	list_del(&dev->devlist);
-	mutex_unlock(&TW68_devlist_lock);
 	TW68_devcount--;
 
 	/* the DMA sound modules should be unloaded before reaching
@@ -1678,11 +3029,15 @@ static void TW68_finidev(struct pci_dev *pci_dev)
 	//      dev->dmasound.priv_data = NULL;
 	//}
 
-	del_timer(&dev->delay_resync);
+	del_timer_sync(&dev->delay_resync);
 
 	/* release resources */
 	/// remove IRQ
+	irq_set_affinity_hint(pci_dev->irq, NULL);
 	free_irq(pci_dev->irq, dev);	/////////  0420
+	if (dev->msi)
+		pci_disable_msi(pci_dev);
+	destroy_workqueue(dev->vid_wq);
 	iounmap(dev->lmmio);
 	release_mem_region(pci_resource_start(pci_dev, 0),
 			   pci_resource_len(pci_dev, 0));
@@ -1690,21 +3045,17 @@ static void TW68_finidev(struct pci_dev *pci_dev)
 	TW68_pgtable_free(dev->pci, &dev->m_Page0);
 
 	for (n = 0; n < 8; n++)
-		for (m = 0; m < 4; m++) {
-			pci_free_consistent(dev->pci, 800 * 300 * 2,
-					    dev->BDbuf[n][m].cpu,
-					    dev->BDbuf[n][m].dma_addr);
-		}
+		BD_free(dev, n);
 
 	TW68_pgtable_free(dev->pci, &dev->m_AudioBuffer);
 
-	for (k = 0; k < 8; k++) {
-		dma_field_free(&dev->Field_P[k]);
-		dma_field_free(&dev->Field_B[k]);
-	}
+	for (k = 0; k < 8; k++)
+		SG_field_free(dev, k);
+	TW68_pool_drain(dev);
 
 	TW68_unregister_video(dev);
 	TW68_alsa_free(dev);
+	TW68_video_fini1(dev);
 
 	//v4l2_device_unregister(&dev->v4l2_dev);
 	printk(KERN_INFO " unregistered v4l2_dev device  %d %d %d\n",
@@ -1728,6 +3079,8 @@ static struct pci_driver TW68_pci_driver = {
 static int TW68_init(void)
 {
 	INIT_LIST_HEAD(&TW686v_devlist);
+	TW68_copy_init();
+	TW68_vb_init();
 	printk(KERN_INFO "TW68_: v4l2 driver version %d.%d.%d loaded\n",
 	       TW68_VERSION_CODE >> 16, (TW68_VERSION_CODE >> 8) & 0xFF,
 	       TW68_VERSION_CODE & 0xFF);
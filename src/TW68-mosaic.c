@@ -0,0 +1,616 @@
+/*
+ *
+ * device driver for TW6869 based PCIe capture cards
+ * mosaic (QF) view: layout, tile channels and frame completion
+ *
+ * The QF device shows up to 16 DMA channels, of this board or of other
+ * boards, as tiles of one frame.  Each tile channel is scaled to its tile
+ * by its own decoder, so the CPU never resamples.  The layout is set
+ * through the board's "mosaic" attribute:
+ *
+ *   echo "3x3 0:0 0:1 0:2 0:3 0:4 0:5 0:6 0:7 1:0" > .../mosaic
+ *   echo "4x4 0:0*2x2 0:1 0:2 0:3 0:4 1:0 1:1 1:2 1:3 1:4 1:5 1:6 1:7" > ...
+ *
+ * The first word is the grid, then one tile per word, board:channel with
+ * an optional *COLSxROWS span.  Tiles fill the free cells row by row, "-"
+ * leaves a cell empty.  A board has two mosaic devices, "mosaic" sets the
+ * first and "mosaic2" the second; by default they show inputs 0-3 and 4-7
+ * as 2x2, so an 8 input card is previewed at the bandwidth of two frames.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+
+#include "TW68.h"
+#include "TW68_defines.h"
+
+static struct TW68_dev *mosaic_dev(struct device *d)
+{
+	struct v4l2_device *v4l2_dev = dev_get_drvdata(d);
+
+	return container_of(v4l2_dev, struct TW68_dev, v4l2_dev);
+}
+
+static struct device_attribute dev_attr_mosaic2, dev_attr_mosaic2_deadline;
+
+/* the mosaic an attribute belongs to */
+static struct TW68_mosaic *mosaic_of(struct device *d,
+				     struct device_attribute *attr)
+{
+	struct TW68_dev *dev = mosaic_dev(d);
+
+	if (attr == &dev_attr_mosaic2 || attr == &dev_attr_mosaic2_deadline)
+		return &dev->mosaic[1];
+	return &dev->mosaic[0];
+}
+
+/* video_opened bit of the mosaic's QF node */
+static u32 mosaic_opened(struct TW68_mosaic *m)
+{
+	return TW68_QF_OPENED(m - m->dev->mosaic);
+}
+
+/* board by number, called with TW686v_devlist_lock held */
+static struct TW68_dev *mosaic_board(unsigned int nr)
+{
+	struct TW68_dev *dev;
+
+	list_for_each_entry(dev, &TW686v_devlist, devlist)
+		if (dev->nr == nr)
+			return dev;
+	return NULL;
+}
+
+/* layout cells covered by tile t, bit row * cols + col */
+static u32 mosaic_cells(struct TW68_mosaic *m, struct TW68_tile *t)
+{
+	u32 mask = 0;
+	unsigned int c, r;
+
+	for (r = t->row; r < t->row + t->rows; r++)
+		for (c = t->col; c < t->col + t->cols; c++)
+			mask |= 1 << (r * m->cols + c);
+	return mask;
+}
+
+/* the QF buffer being filled */
+static struct TW68_buf *mosaic_curr(struct TW68_mosaic *m)
+{
+	struct TW68_dev *dev = m->dev;
+	struct TW68_buf *curr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	curr = dev->video_dmaq[m->node].curr;
+	spin_unlock_irqrestore(&dev->slock, flags);
+	return curr;
+}
+
+/* hand the composed frame to userspace, called with dev->qf_lock held */
+static void mosaic_finish(struct TW68_mosaic *m)
+{
+	struct TW68_dev *dev = m->dev;
+	struct TW68_dmaqueue *q = &dev->video_dmaq[m->node];
+
+	q->curr->vb.v4l2_buf.sequence = dev->video_fieldcount[m->node]++;
+	TW68_buffer_finish(dev, q, VB2_BUF_STATE_DONE);
+	m->done = 0;
+	m->buf = NULL;
+}
+
+/*
+ * Deadline of a frame with mosaic_deadline set: the tiles that did not
+ * make it repeat the newest frame their channel delivered, so a dead
+ * camera freezes its own tile instead of the whole mosaic.
+ */
+static void mosaic_expire(struct work_struct *work)
+{
+	struct TW68_mosaic *m =
+	    container_of(to_delayed_work(work), struct TW68_mosaic, expire);
+	struct TW68_dev *dev = m->dev;
+	struct TW68_tile *t;
+	unsigned long due;
+	int k;
+
+	mutex_lock(&dev->qf_lock);
+	if (0 == m->done || dev->video_dmaq[m->node].curr != m->buf)
+		goto out;
+
+	due = m->started + msecs_to_jiffies(m->deadline);
+	if (time_before(jiffies, due)) {
+		/* an earlier frame's deadline, wait for this one's */
+		queue_delayed_work(dev->vid_wq, &m->expire, due - jiffies);
+		goto out;
+	}
+
+	for (k = 0; k < m->ntiles; k++) {
+		t = &m->tile[k];
+		if (!((m->done | m->gone) & (1 << k)) && t->last >= 0)
+			QF_Tile_Copy(t, t->last);
+	}
+	mosaic_finish(m);
+out:
+	mutex_unlock(&dev->qf_lock);
+}
+
+void TW68_mosaic_init(struct TW68_dev *dev)
+{
+	struct TW68_mosaic *m;
+	int i, k;
+
+	for (i = 0; i < TW68_MOSAICS; i++) {
+		m = &dev->mosaic[i];
+		m->dev = dev;
+		m->node = i ? TW68_QF2_NODE : 0;
+		dev->video_dmaq[m->node].mosaic = m;
+		for (k = 0; k < TW68_MOSAIC_TILES; k++) {
+			m->tile[k].dev = dev;
+			m->tile[k].m = m;
+		}
+
+		/* inputs 0-3, 4-7 as 2x2 */
+		m->cols = 2;
+		m->rows = 2;
+		m->ntiles = 4;
+		for (k = 0; k < 4; k++) {
+			m->tile[k].board = dev->nr;
+			m->tile[k].ch = i * 4 + k;
+			m->tile[k].col = k & 1;
+			m->tile[k].row = k >> 1;
+			m->tile[k].cols = 1;
+			m->tile[k].rows = 1;
+		}
+		INIT_DELAYED_WORK(&m->expire, mosaic_expire);
+	}
+}
+
+static ssize_t mosaic_show(struct device *d, struct device_attribute *attr,
+			   char *buf)
+{
+	struct TW68_mosaic *m = mosaic_of(d, attr);
+	struct TW68_tile *t;
+	unsigned int cell, k;
+	u32 used = 0;
+	int len;
+
+	for (k = 0; k < m->ntiles; k++)
+		used |= mosaic_cells(m, &m->tile[k]);
+
+	len = sprintf(buf, "%ux%u", m->cols, m->rows);
+	for (cell = 0; cell < m->cols * m->rows; cell++) {
+		for (k = 0; k < m->ntiles; k++) {
+			t = &m->tile[k];
+			if (t->row * m->cols + t->col == cell)
+				break;
+		}
+		if (k == m->ntiles) {
+			if (!(used & (1 << cell)))
+				len += sprintf(buf + len, " -");
+			continue;
+		}
+		len += sprintf(buf + len, " %u:%u", t->board, t->ch);
+		if (t->cols > 1 || t->rows > 1)
+			len += sprintf(buf + len, "*%ux%u", t->cols, t->rows);
+	}
+	len += sprintf(buf + len, "\n");
+	return len;
+}
+
+static ssize_t mosaic_store(struct device *d, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct TW68_mosaic *m = mosaic_of(d, attr);
+	struct TW68_mosaic *layout;
+	struct TW68_tile *t;
+	char str[256], *p = str, *tok;
+	unsigned int cell, k;
+	u32 used = 0, mask;
+	int err = -EINVAL;
+
+	if (count >= sizeof(str))
+		return -EINVAL;
+	memcpy(str, buf, count);
+	str[count] = 0;
+
+	layout = kzalloc(sizeof(*layout), GFP_KERNEL);
+	if (NULL == layout)
+		return -ENOMEM;
+
+	do
+		tok = strsep(&p, " \t\n");
+	while (tok && !*tok);
+	if (!tok || sscanf(tok, "%ux%u", &layout->cols, &layout->rows) != 2 ||
+	    layout->cols < 1 || layout->cols > 4 ||
+	    layout->rows < 1 || layout->rows > 4)
+		goto out;
+
+	cell = 0;
+	while ((tok = strsep(&p, " \t\n"))) {
+		if (!*tok)
+			continue;
+		/* next cell no earlier tile covers */
+		while (cell < layout->cols * layout->rows && (used & (1 << cell)))
+			cell++;
+		if (cell == layout->cols * layout->rows)
+			goto out;
+		if (!strcmp(tok, "-")) {
+			used |= 1 << cell;
+			continue;
+		}
+		if (layout->ntiles == TW68_MOSAIC_TILES)
+			goto out;
+
+		t = &layout->tile[layout->ntiles];
+		t->cols = 1;
+		t->rows = 1;
+		k = sscanf(tok, "%u:%u*%ux%u", &t->board, &t->ch,
+			   &t->cols, &t->rows);
+		if ((k != 2 && k != 4) || t->ch > 7 || !t->cols || !t->rows)
+			goto out;
+		t->col = cell % layout->cols;
+		t->row = cell / layout->cols;
+		if (t->col + t->cols > layout->cols ||
+		    t->row + t->rows > layout->rows)
+			goto out;
+
+		mask = mosaic_cells(layout, t);
+		if (used & mask)
+			goto out;
+		used |= mask;
+
+		/* a channel has one scaler and one DMA, so one tile */
+		for (k = 0; k < layout->ntiles; k++)
+			if (layout->tile[k].board == t->board &&
+			    layout->tile[k].ch == t->ch)
+				goto out;
+		layout->ntiles++;
+	}
+	if (0 == layout->ntiles)
+		goto out;
+
+	err = 0;
+	mutex_lock(&TW686v_devlist_lock);
+	if (m->dev->video_opened & mosaic_opened(m)) {
+		err = -EBUSY;
+	} else {
+		m->cols = layout->cols;
+		m->rows = layout->rows;
+		m->ntiles = layout->ntiles;
+		for (k = 0; k < layout->ntiles; k++) {
+			layout->tile[k].dev = m->dev;
+			layout->tile[k].m = m;
+			m->tile[k] = layout->tile[k];
+		}
+	}
+	mutex_unlock(&TW686v_devlist_lock);
+out:
+	kfree(layout);
+	return err ? err : count;
+}
+
+static DEVICE_ATTR(mosaic, S_IRUGO | S_IWUSR, mosaic_show, mosaic_store);
+static DEVICE_ATTR(mosaic2, S_IRUGO | S_IWUSR, mosaic_show, mosaic_store);
+
+static ssize_t mosaic_deadline_show(struct device *d,
+				    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", mosaic_of(d, attr)->deadline);
+}
+
+static ssize_t mosaic_deadline_store(struct device *d,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct TW68_mosaic *m = mosaic_of(d, attr);
+	unsigned int ms;
+	int err = 0;
+
+	if (kstrtouint(buf, 0, &ms))
+		return -EINVAL;
+
+	mutex_lock(&TW686v_devlist_lock);
+	if (m->dev->video_opened & mosaic_opened(m))
+		err = -EBUSY;
+	else
+		m->deadline = ms;
+	mutex_unlock(&TW686v_devlist_lock);
+
+	return err ? err : count;
+}
+
+static DEVICE_ATTR(mosaic_deadline, S_IRUGO | S_IWUSR, mosaic_deadline_show,
+		   mosaic_deadline_store);
+static DEVICE_ATTR(mosaic2_deadline, S_IRUGO | S_IWUSR, mosaic_deadline_show,
+		   mosaic_deadline_store);
+
+static struct attribute *mosaic_attrs[] = {
+	&dev_attr_mosaic.attr,
+	&dev_attr_mosaic_deadline.attr,
+	&dev_attr_mosaic2.attr,
+	&dev_attr_mosaic2_deadline.attr,
+	NULL
+};
+
+static const struct attribute_group mosaic_group = {
+	.attrs = mosaic_attrs,
+};
+
+int TW68_mosaic_sysfs_add(struct TW68_dev *dev)
+{
+	return sysfs_create_group(&dev->pci->dev.kobj, &mosaic_group);
+}
+
+void TW68_mosaic_sysfs_remove(struct TW68_dev *dev)
+{
+	sysfs_remove_group(&dev->pci->dev.kobj, &mosaic_group);
+}
+
+/*
+ * Tile rectangles for a width x height mosaic.  Cells are cut to whole
+ * pixel groups and line pairs, what is left over at the right and bottom
+ * edge is not written.  The tile channels DMA straight into the QF buffers
+ * when they all sit on this board and zero-copy capture is on; a deadline
+ * needs the copy path, a tile may be overtaken there but not in a buffer
+ * the hardware still writes.
+ */
+void TW68_mosaic_geometry(struct TW68_mosaic *m, struct TW68_format *fmt,
+			  unsigned int width, unsigned int height)
+{
+	struct TW68_dev *dev = m->dev;
+	unsigned int pitch = TW68_dma_pitch(fmt, width);
+	unsigned int cw, ch, align, k;
+	struct TW68_tile *t;
+
+	align = fmt->hshift > 1 ? 8 : 4;
+	cw = (width / m->cols) & ~(align - 1);
+	ch = (height / m->rows) & ~1;
+
+	m->vf = fmt->vf;
+	m->direct = (dev->capture_mode == TW68_CAPTURE_CONTIG && 0 == m->deadline);
+	for (k = 0; k < m->ntiles; k++) {
+		t = &m->tile[k];
+		t->width = cw * t->cols;
+		t->height = ch * t->rows;
+		t->dst_off = t->row * ch * pitch + TW68_dma_pitch(fmt, t->col * cw);
+		t->wbytes = TW68_dma_pitch(fmt, t->width);
+		if (t->board != dev->nr)
+			m->direct = 0;
+	}
+	/* zero-copy tiles are written with the mosaic pitch, the rest compact */
+	for (k = 0; k < m->ntiles; k++)
+		m->tile[k].pitch = m->direct ? pitch : m->tile[k].wbytes;
+}
+
+/* program channel t->ch of board t->src (dev here) for its tile */
+static void mosaic_channel_setup(struct TW68_dev *dev, struct TW68_tile *t,
+				 u32 vf)
+{
+	u32 m_dwCHConfig, ChannelOffset, pgn, dec;
+	u32 m_StartIdx, m_EndIdx;
+	unsigned int nId = t->ch;
+
+	ChannelOffset = (PAGE_SIZE << 1) / 8 / 8;
+
+	if (nId < 4)
+		reg_writel(DECODER0_SDT + (nId * 0x10), 7);	/// 0 NTSC
+
+	dec = TW68_decoder_setup(dev, nId, t->height / 2, t->width);	// Field size
+
+	BFDMA_setup(dev, nId, t->height / 2, t->wbytes, t->pitch);
+
+	pgn = TW68_buffer_pages(t->pitch * t->height / 2) - 1;	// page number for 1 field
+	m_StartIdx = ChannelOffset * nId;
+	m_EndIdx = m_StartIdx + pgn;
+
+	m_dwCHConfig = (m_StartIdx & 0x3FF) |	// 10 bits
+	    ((m_EndIdx & 0x3FF) << 10) |	// 10 bits
+	    ((vf & 7) << 20) |
+	    (!!(dec & TW68_DECIMATE_H) << 23) |
+	    (!!(dec & TW68_DECIMATE_V) << 24) |
+	    (1 << 27);		// drop master
+	reg_writel(DMA_CH0_CONFIG + nId, m_dwCHConfig);
+
+	tw68v_set_framerate(dev, nId, t->m->fps);
+}
+
+/* give the tile channels back, called with TW686v_devlist_lock held */
+static void mosaic_unclaim(struct TW68_mosaic *m, int n)
+{
+	struct TW68_tile *t;
+	int k;
+
+	for (k = 0; k < n; k++) {
+		t = &m->tile[k];
+		if (NULL == t->src)
+			continue;	// its board went away
+		t->src->tile[t->ch] = NULL;
+		t->src->video_opened &= ~(1 << t->ch);
+		t->src = NULL;
+	}
+}
+
+/*
+ * The tile boards are held by TW686v_devlist_lock from claim to unclaim,
+ * so a board being removed waits in TW68_mosaic_board_gone() instead of
+ * leaving t->src behind.
+ */
+int TW68_mosaic_start(struct TW68_mosaic *m)
+{
+	struct TW68_dev *dev = m->dev;
+	struct TW68_tile *t;
+	int k, err = 0;
+
+	/* the tile channels are taken like an open main node takes them */
+	mutex_lock(&TW686v_devlist_lock);
+	m->gone = 0;
+	for (k = 0; k < m->ntiles; k++) {
+		t = &m->tile[k];
+		t->src = mosaic_board(t->board);
+		if (NULL == t->src) {
+			err = -ENODEV;
+			break;
+		}
+		if ((t->src->video_opened & ((1 << t->ch) | (1 << (t->ch + 8)))) ||
+		    t->src->tile[t->ch]) {
+			t->src = NULL;
+			err = -EBUSY;
+			break;
+		}
+		t->src->video_opened |= 1 << t->ch;
+		t->src->tile[t->ch] = t;
+		t->last = -1;
+	}
+	if (err) {
+		printk(KERN_INFO "%s: mosaic tile %d:%d is %s\n", dev->name,
+		       m->tile[k].board, m->tile[k].ch,
+		       err == -EBUSY ? "in use" : "not there");
+		mosaic_unclaim(m, k);
+		goto out;
+	}
+
+	for (k = 0; k < m->ntiles; k++) {
+		t = &m->tile[k];
+		err = BD_alloc(t->src, t->ch, t->pitch * t->height);
+		if (err) {
+			while (k--)
+				BD_free(m->tile[k].src, m->tile[k].ch);
+			mosaic_unclaim(m, m->ntiles);
+			goto out;
+		}
+		mosaic_channel_setup(t->src, t, m->vf);
+	}
+
+	m->done = 0;
+	m->buf = NULL;
+	if (m->direct)
+		QF_Start(m);
+	for (k = 0; k < m->ntiles; k++)
+		TW68_set_dmabits(m->tile[k].src, m->tile[k].ch);
+out:
+	mutex_unlock(&TW686v_devlist_lock);
+	return err;
+}
+
+void TW68_mosaic_stop(struct TW68_mosaic *m)
+{
+	struct TW68_tile *t;
+	int k;
+
+	mutex_lock(&TW686v_devlist_lock);
+	for (k = 0; k < m->ntiles; k++)
+		if (m->tile[k].src)
+			stop_video_DMA(m->tile[k].src, m->tile[k].ch);
+	/* no tile events past this point */
+	for (k = 0; k < m->ntiles; k++) {
+		t = &m->tile[k];
+		if (NULL == t->src)
+			continue;
+		synchronize_irq(t->src->pci->irq);
+		flush_work(&t->src->video_dmaq[t->ch + 1].work);
+	}
+	cancel_delayed_work_sync(&m->expire);
+
+	if (m->direct)
+		QF_Release(m);
+	for (k = 0; k < m->ntiles; k++)
+		if (m->tile[k].src)
+			BD_free(m->tile[k].src, m->tile[k].ch);
+	mosaic_unclaim(m, m->ntiles);
+	mutex_unlock(&TW686v_devlist_lock);
+}
+
+/*
+ * Board dev is being removed: the mosaics of the other boards drop the
+ * tiles they stream from it and complete their frames without them.
+ */
+void TW68_mosaic_board_gone(struct TW68_dev *dev)
+{
+	struct TW68_dev *owner;
+	struct TW68_mosaic *m;
+	struct TW68_tile *t;
+	int i, k;
+
+	mutex_lock(&TW686v_devlist_lock);
+	for (k = 0; k < 8; k++) {
+		t = dev->tile[k];
+		if (t && t->dev != dev)
+			stop_video_DMA(dev, k);
+	}
+	synchronize_irq(dev->pci->irq);
+	for (k = 0; k < 8; k++)
+		flush_work(&dev->video_dmaq[k + 1].work);
+
+	list_for_each_entry(owner, &TW686v_devlist, devlist) {
+		if (owner == dev)
+			continue;
+		for (i = 0; i < TW68_MOSAICS; i++) {
+			m = &owner->mosaic[i];
+			mutex_lock(&owner->qf_lock);
+			for (k = 0; k < m->ntiles; k++) {
+				t = &m->tile[k];
+				if (t->src != dev)
+					continue;
+				printk(KERN_INFO "%s: mosaic tile %d:%d removed\n",
+				       owner->name, t->board, t->ch);
+				BD_free(dev, t->ch);
+				dev->tile[t->ch] = NULL;
+				dev->video_opened &= ~(1 << t->ch);
+				t->src = NULL;
+				m->gone |= 1 << k;
+			}
+			if (m->done && m->buf == mosaic_curr(m) &&
+			    (m->done | m->gone) == (1 << m->ntiles) - 1)
+				mosaic_finish(m);
+			mutex_unlock(&owner->qf_lock);
+		}
+	}
+	mutex_unlock(&TW686v_devlist_lock);
+}
+
+/* a tile channel completed frame Fn/PB, called from its board's work */
+void TW68_mosaic_done(struct TW68_tile *t, u32 Fn, u32 PB)
+{
+	struct TW68_dev *dev = t->dev;
+	struct TW68_mosaic *m = t->m;
+	u32 bit = 1 << (t - m->tile);
+	struct TW68_buf *curr;
+	int n;
+
+	n = 0;
+	if (Fn)
+		n = 2;
+	if (PB)
+		n++;
+
+	if (m->direct) {
+		QF_Done(t, n);
+		return;
+	}
+
+	mutex_lock(&dev->qf_lock);
+	t->last = n;
+	curr = mosaic_curr(m);
+	if (curr != m->buf) {
+		/* a new frame, or the old one timed out */
+		m->buf = curr;
+		m->done = 0;
+	}
+	if (curr && !(m->done & bit)) {
+		QF_Tile_Copy(t, n);
+		if (0 == m->done) {
+			m->started = jiffies;
+			if (m->deadline)
+				queue_delayed_work(dev->vid_wq, &m->expire,
+						   msecs_to_jiffies(m->deadline));
+		}
+		m->done |= bit;
+		if ((m->done | m->gone) == (1 << m->ntiles) - 1)
+			mosaic_finish(m);
+	}
+	mutex_unlock(&dev->qf_lock);
+}
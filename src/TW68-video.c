@@ -35,6 +35,7 @@ static unsigned int gbufsize = 800 * 576 * 4;
 static unsigned int gbufsize_max = 800 * 576 * 4;
 static char secam[] = "--";
 static unsigned int VideoFrames_limit = 64;	//16
+static unsigned int capture_mode = TW68_CAPTURE_COPY;
 
 module_param(video_debug, int, 0644);
 MODULE_PARM_DESC(video_debug, "enable debug messages [video]");
@@ -44,6 +45,9 @@ module_param(noninterlaced, int, 0644);
 MODULE_PARM_DESC(noninterlaced, "capture non interlaced video");
 module_param_string(secam, secam, sizeof(secam), 0644);
 MODULE_PARM_DESC(secam, "force SECAM variant, either DK,L or Lc");
+module_param(capture_mode, int, 0444);
+MODULE_PARM_DESC(capture_mode,
+		 "video buffers: 0 = copy from DMA buffer, 1 = zero-copy DMA (dma-contig), 2 = zero-copy scatter-gather DMA");
 
 #define dprintk(fmt, arg...)	if (video_debug&0x04) \
 	printk(KERN_DEBUG "%s/video: " fmt, dev->name , ## arg)
@@ -66,12 +70,47 @@ static struct TW68_format formats[] = {
 		.pm = 0x00,
 		.bswap = 1,
 		.yuv = 1,
+		.vf = VIDEO_FORMAT_YUYV,
 	}, {
 		.name = "4:2:2 packed, UYVY",
 		.fourcc = V4L2_PIX_FMT_UYVY,
 		.depth = 16,
 		.pm = 0x00,
 		.yuv = 1,
+		.vf = VIDEO_FORMAT_UYVY,
+	}, {
+		.name = "4:1:1 packed, Y41P",
+		.fourcc = V4L2_PIX_FMT_Y41P,
+		.depth = 12,
+		.hshift = 2,
+		.yuv = 1,
+		.vf = VIDEO_FORMAT_Y41P,
+	}, {
+		.name = "8 bpp, gray",
+		.fourcc = V4L2_PIX_FMT_GREY,
+		.depth = 8,
+		.convert = 1,
+		.vf = VIDEO_FORMAT_YUYV,
+	}, {
+		.name = "4:2:0 planar, Y/CbCr",
+		.fourcc = V4L2_PIX_FMT_NV12,
+		.depth = 12,
+		.vshift = 1,
+		.hshift = 1,
+		.yuv = 1,
+		.planar = 1,
+		.convert = 1,
+		.vf = VIDEO_FORMAT_YUYV,
+	}, {
+		.name = "4:2:0 planar, Y-Cb-Cr",
+		.fourcc = V4L2_PIX_FMT_YUV420,
+		.depth = 12,
+		.vshift = 1,
+		.hshift = 1,
+		.yuv = 1,
+		.planar = 1,
+		.convert = 1,
+		.vf = VIDEO_FORMAT_YUYV,
 	}
 };
 
@@ -245,11 +284,16 @@ static struct TW68_tvnorm tvnorms[] = {
 
 #define TVNORMS ARRAY_SIZE(tvnorms)
 
+/* smallest picture the scalers make, see TW68_try_fmt_vid_cap() */
+#define TW68_MIN_WIDTH	80
+#define TW68_MIN_HEIGHT	60
+
 #define V4L2_CID_PRIVATE_INVERT      (V4L2_CID_PRIVATE_BASE + 0)
 #define V4L2_CID_PRIVATE_Y_ODD       (V4L2_CID_PRIVATE_BASE + 1)
 #define V4L2_CID_PRIVATE_Y_EVEN      (V4L2_CID_PRIVATE_BASE + 2)
 #define V4L2_CID_PRIVATE_AUTOMUTE    (V4L2_CID_PRIVATE_BASE + 3)
-#define V4L2_CID_PRIVATE_LASTP1      (V4L2_CID_PRIVATE_BASE + 4)
+#define V4L2_CID_PRIVATE_DEINTERLACE (V4L2_CID_PRIVATE_BASE + 4)
+#define V4L2_CID_PRIVATE_LASTP1      (V4L2_CID_PRIVATE_BASE + 5)
 
 static const struct v4l2_queryctrl no_ctrl = {
 	.name = "42",
@@ -338,9 +382,24 @@ static const struct v4l2_queryctrl video_ctrls[] = {
 		.step = 1,
 		.default_value = 1,
 		.type = V4L2_CTRL_TYPE_BOOLEAN,
+	}, {
+		.id = V4L2_CID_PRIVATE_DEINTERLACE,
+		.name = "deinterlace",
+		.minimum = TW68_DEINT_WEAVE,
+		.maximum = TW68_DEINT_ADAPT,
+		.step = 1,
+		.default_value = TW68_DEINT_WEAVE,
+		.type = V4L2_CTRL_TYPE_MENU,
 	}
 };
 
+static const char *const deinterlace_menu[] = {
+	[TW68_DEINT_WEAVE] = "weave",
+	[TW68_DEINT_BOB] = "bob",
+	[TW68_DEINT_LINEAR] = "linear blend",
+	[TW68_DEINT_ADAPT] = "motion adaptive",
+};
+
 static const unsigned int CTRLS = ARRAY_SIZE(video_ctrls);
 
 static const struct v4l2_queryctrl *ctrl_by_id(int id)
@@ -368,6 +427,18 @@ static const struct v4l2_queryctrl *ctrl_by_id(int id)
 	return NULL;
 }
 
+/* converted formats need the copy pass, which only copy mode has */
+static int format_usable(struct TW68_fh *fh, struct TW68_format *fmt)
+{
+	/* RGB: the byte order the chip writes is not verified */
+	if (!fmt->yuv && !fmt->convert)
+		return 0;
+	if (fmt->convert)
+		return fh->capture_mode == TW68_CAPTURE_COPY &&
+		    fh->DMA_nCH != 0xF;
+	return 1;
+}
+
 static struct TW68_format *format_by_fourcc(unsigned int fourcc)
 {
 	unsigned int i;
@@ -381,13 +452,20 @@ static struct TW68_format *format_by_fourcc(unsigned int fourcc)
 /* ----------------------------------------------------------------------- */
 /* resource management                                                     */
 
-static int res_get(struct TW68_dev *dev, struct TW68_fh *fh, unsigned int bit)
+/* video_dmaq[] index of a file handle */
+static int TW68_qid(struct TW68_fh *fh)
 {
-	u32 nId;
+	if (fh->DMA_nCH == 0xF)
+		return fh->qf ? TW68_QF2_NODE : 0;
+	if (fh->sub)
+		return TW68_SUB_NODE + fh->DMA_nCH;
+	return fh->DMA_nCH + 1;
+}
 
-	nId = fh->DMA_nCH;
-	if (nId == 0xF)
-		nId = 0;
+/* every node, sub-streams and QF muxes too, has its own resources */
+static int res_get(struct TW68_dev *dev, struct TW68_fh *fh, unsigned int bit)
+{
+	u32 nId = TW68_qid(fh);
 
 	if (fh->resources & bit)
 		/* have it already allocated */
@@ -415,11 +493,7 @@ static int res_check(struct TW68_fh *fh, unsigned int bit)
 static int res_locked(struct TW68_fh *fh, struct TW68_dev *dev,
 		      unsigned int bit)
 {
-	u32 nId = fh->DMA_nCH;
-
-	if (nId == 0xF)
-		nId = 0;
-	// if (nId >4)   return 0;
+	u32 nId = TW68_qid(fh);
 
 	return (dev->resources[nId] & bit);
 }
@@ -429,9 +503,7 @@ void res_free(struct TW68_fh *fh, unsigned int bits)
 {
 	struct TW68_dev *dev = fh->dev;
 
-	u32 nId = fh->DMA_nCH;
-	if (nId == 0xF)
-		nId = 0;
+	u32 nId = TW68_qid(fh);
 
 	mutex_lock(&dev->lock);
 	fh->resources &= ~bits;
@@ -444,27 +516,18 @@ void res_free(struct TW68_fh *fh, unsigned int bits)
 
 static void set_tvnorm(struct TW68_dev *dev, struct TW68_tvnorm *norm)
 {
-	int framesize;
-
 	dev->tvnorm = norm;
+}
 
-	/* setup cropping */
-	dev->crop_bounds.left = norm->h_start;
-	dev->crop_defrect.left = norm->h_start;
-	dev->crop_bounds.width = norm->h_stop - norm->h_start + 1;
-	dev->crop_defrect.width = norm->h_stop - norm->h_start + 1;
-
-	dev->crop_bounds.top = (norm->vbi_v_stop_0 + 1) * 2;
-	dev->crop_defrect.top = norm->video_v_start * 2;
-	dev->crop_bounds.height =
-	    ((norm->id & V4L2_STD_525_60) ? 524 : 622) - dev->crop_bounds.top;
-	dev->crop_defrect.height =
-	    (norm->video_v_stop - norm->video_v_start + 1) * 2;
-
-	dev->crop_current = dev->crop_defrect;
-
-	framesize = dev->crop_bounds.width * dev->crop_bounds.height * 16 >> 3;	// calculate byte size for 1 frame
+/* crop bounds of a node: the whole active picture, see TW68_crop_window() */
+static void TW68_crop_bounds(struct TW68_fh *fh, struct v4l2_rect *b)
+{
+	int k = (fh->DMA_nCH == 0xF) ? 0 : fh->DMA_nCH + 1;
 
+	b->left = 0;
+	b->top = 0;
+	b->width = 720;
+	b->height = fh->dev->PAL50[k] ? 576 : 480;
 }
 
 /* ------------------------------------------------------------------ */
@@ -480,152 +543,163 @@ struct cliplist {
 static int buffer_activate(struct TW68_dev *dev,	///unsigned int nId,
 			   struct TW68_buf *buf, struct TW68_buf *next)
 {
-	buf->vb.state = VIDEOBUF_ACTIVE;
 	buf->top_seen = 0;
+	buf->early_us = 0;
 
 	return 0;		//-1;
 }
 
-static void free_buffer(struct videobuf_queue *q, struct TW68_buf *buf)
+static int buffer_prepare(struct vb2_buffer *vb)
 {
-	videobuf_vmalloc_free(&buf->vb);
-	buf->vb.state = VIDEOBUF_NEEDS_INIT;
-}
-
-static int buffer_prepare(struct videobuf_queue *q,
-			  struct videobuf_buffer *vb, enum v4l2_field field)
-{
-	struct TW68_fh *fh = q->priv_data;
+	struct TW68_fh *fh = vb2_get_drv_priv(vb->vb2_queue);
 	struct TW68_dev *dev = fh->dev;
 	struct TW68_buf *buf = container_of(vb, struct TW68_buf, vb);
 	unsigned int size;
-	unsigned int DMA_nCH = fh->DMA_nCH;
-	unsigned int nId = 0;
+	unsigned int nId;
 
 	int err;
 
-	if (DMA_nCH == 0XF)
-		///DMA_nCH =0;
-		nId = 0;
-
 	/* sanity checks */
 	if (NULL == fh->fmt)
 		return -EINVAL;
 
 	size = (fh->width * fh->height * fh->fmt->depth) >> 3;
-	if (0 != buf->vb.baddr && buf->vb.bsize < size)
+	/*
+	   USERPTR goes through get_user_pages() and so still fails with -EFAULT
+	   on VM_IO / VM_PFNMAP memory that another driver ioremap'ed or
+	   dma_alloc_coherent'ed.  Such memory should be shared as a dma-buf
+	   instead: V4L2_MEMORY_DMABUF imports it here with its own sg_table
+	   (or contiguous address in capture_mode=1), so the chip writes into
+	   the encoder's buffers directly.
+	 */
+	if (vb2_plane_size(vb, 0) < size)
 		return -EINVAL;
 	////  cause PAL stop
 
-	if (VIDEOBUF_NEEDS_INIT == buf->vb.state) {
-
-		buf->vb.width = fh->width;
-		buf->vb.height = fh->height;
-		buf->vb.size = size;
-		buf->vb.field = field;
-		buf->fmt = fh->fmt;
-		buf->pt = &fh->pt_cap;
-		nId = DMA_nCH + 1;
-
-		dev->video_dmaq[nId].curr = NULL;
-
-		/*
-		   If I understand correctly, the videobuf_iolock function is responsible for
-		   mapping user pages to kernel. This works fine as long as user application allocates
-		   memory/buffer using some standard API (malloc/memalign).
+	vb2_set_plane_payload(vb, 0, size);
+	vb->v4l2_buf.field = fh->field;
 
-		   But it fails where; user application has allocated memory/buffer using ioremap
-		   from another driver. The use case scenario is something -
-
-		   - Open V4L2 device (which supports scatter gather DMA)
-		   - Configure the parameters (especially .memory=V4L2_MEMORY_USERPTR)
-		   - Request and query the buffer
-		   - open another device which will be responsible for allocating memory
-		   Either using ioremap/dma_alloc_coherent/get_free_pages
-		   - Queue the buffers with buffer address received from previous step
+	buf->width = fh->width;
+	buf->height = fh->height;
+	buf->size = size;
+	buf->fmt = fh->fmt;
+	buf->pt = &fh->pt_cap;
+	buf->activate = buffer_activate;	//set activate fn ptr
 
-		   Here it internally calls drv_prepare function, which call videobuf_iolock API for mapping the user pages to kernel and will create scatter-gather (dma->sglist) list. But this API returns from videobuf_dma_init_user_locked with -EFAULT.
+	if (fh->capture_mode == TW68_CAPTURE_SG) {
+		struct sg_table *sgt = vb2_dma_sg_plane_desc(vb, 0);
+		struct TW68_dmaqueue *dq;
+
+		nId = fh->DMA_nCH + 1;
+		dq = &dev->video_dmaq[nId];
+
+		err = SG_Chain(buf->sgdesc[0], sgt->sgl, sgt->nents,
+			       0, dq->sg_fieldsize, dq->sg_count);
+		if (!err)
+			err = SG_Chain(buf->sgdesc[1], sgt->sgl, sgt->nents,
+				       dq->sg_fieldsize, dq->sg_fieldsize,
+				       dq->sg_count);
+		if (err < 0) {
+			printk(KERN_ERR "%s: channel %d buffer has no SG chain (%d)\n",
+			       dev->name, fh->DMA_nCH, err);
+			return err;
+		}
+	}
 
-		   I found the get_user_pages returns due to flag VM_IO and VM_PFNMAP for the corresponding vma.
+	return 0;
+}
 
-		   Any suggestions on how can I achieve this?
-		 */
+/* a buffer holds one field, cut out of the frame by the copy pass */
+static int TW68_field_single(enum v4l2_field field)
+{
+	return field == V4L2_FIELD_TOP || field == V4L2_FIELD_BOTTOM ||
+	    field == V4L2_FIELD_ALTERNATE;
+}
 
-		err = videobuf_iolock(q, &buf->vb, &dev->ovbuf);	//
-		if (err < 0)
-			goto oops;
+/* log2 width alignment: whole 4:1:1 pixel groups, in every QF quadrant too */
+static unsigned int TW68_walign(struct TW68_fh *fh, struct TW68_format *fmt)
+{
+	if (fmt->hshift > 1)
+		return fmt->hshift + 1 + (fh->DMA_nCH == 0xF);
+	return 2;
+}
 
-	}
+/* log2 height alignment, the QF tiles are cut to line pairs */
+static unsigned int TW68_halign(struct TW68_fh *fh, struct TW68_format *fmt)
+{
+	if (fh->DMA_nCH == 0xF)
+		return max(fmt->vshift, 2u);
+	return fmt->vshift;
+}
 
-	buf->vb.state = VIDEOBUF_PREPARED;
-	buf->activate = buffer_activate;	//set activate fn ptr
-	return 0;
+/* frame lines the channel DMA captures, field formats take both fields */
+static unsigned int TW68_dma_lines(struct TW68_fh *fh)
+{
+	return TW68_field_single(fh->field) ? fh->height * 2 : fh->height;
+}
 
-oops:
-	printk("buffer_prepare  OOPS \n");
-	free_buffer(q, buf);
+/* frame size the channel BDbuf must hold for the streams set up on it */
+static unsigned int BD_frame_size(struct TW68_dev *dev, int nDMA_channel)
+{
+	struct TW68_dmaqueue *mq = &dev->video_dmaq[nDMA_channel + 1];
+	struct TW68_dmaqueue *sq = &dev->video_dmaq[TW68_SUB_NODE + nDMA_channel];
 
-	return err;
+	return max(mq->pitch * mq->height, sq->pitch * sq->height);
 }
 
-int buffer_setup(struct videobuf_queue *q, unsigned int *count,
-		 unsigned int *size)
+/*
+ * Program channel fh->DMA_nCH for the format of fh: decoder scaling, the
+ * DMA mode and DMA_CH0_CONFIG.  Only while nothing streams on the
+ * channel, or from the main stream's STREAMON once its frames fit.
+ */
+static int TW68_channel_setup(struct TW68_fh *fh)
 {
-	unsigned int ChannelOffset, nId, pgn;
-	u32 m_dwCHConfig, dwReg, dwRegH, dwRegW, nScaler, dwReg2;
+	struct TW68_dev *dev = fh->dev;
+	unsigned int ChannelOffset, nId, pgn, size;
+	u32 m_dwCHConfig, dwReg, dwRegH, dwRegW, nScaler, dwReg2, dec;
 	u32 m_StartIdx, m_EndIdx, m_nVideoFormat,
 	    m_bHorizontalDecimate, m_bVerticalDecimate, m_nDropChannelNum,
 	    m_bDropMasterOrSlave, m_bDropField, m_bDropOddOrEven,
 	    m_nCurVideoChannelNum;
 
-	struct TW68_dev *dev;
-	struct TW68_fh *fh = q->priv_data;
-
-	dev = fh->dev;
-
 	ChannelOffset = (PAGE_SIZE << 1) / 8 / 8;
-	// NTSC  FIELD entry number for 720*240*2
-	/// ChannelOffset = 128;   ///85;
-
-	fh = q->priv_data;
 	nId = fh->DMA_nCH;	// DMA channel
-
-	dwReg2 = reg_readl(DMA_CH0_CONFIG + 2);
-	dwReg = reg_readl(DMA_CH0_CONFIG + nId);
-
-	if (nId == 0XF) {
-		buffer_setup_QF(q, count, size);
-		return 0;
-	}
-
-	*size = fh->fmt->depth * fh->width * fh->height >> 3;	// calculate byte size for 1 frame
+	size = fh->fmt->depth * fh->width * fh->height >> 3;	// 1 frame
 
 	if (nId < 4) {
 		dwReg = reg_readl(DECODER0_SDT + (nId * 0x10));
 		reg_writel(DECODER0_SDT + (nId * 0x10), 7);	/// 0 NTSC
 	}
 
-	DecoderResize(dev, nId, fh->height / 2, fh->width);
+	/* a running sub-stream needs the scaled F2 frames undecimated */
+	dec = 0;
+	if (fh->sub || (dev->streaming & (1 << (nId + 8)))) {
+		DecoderResize(dev, nId, TW68_dma_lines(fh) / 2, fh->width);
+		dev->decimate[nId] = 0;
+	} else
+		dec = TW68_decoder_setup(dev, nId, TW68_dma_lines(fh) / 2, fh->width);
 
-	BFDMA_setup(dev, nId, (fh->height / 2), (*size / fh->height));	// BFbuf setup  DMA mode ...
+	pgn = TW68_buffer_pages(size / 2) - 1;	// page number for 1 field
+
+	if (fh->capture_mode == TW68_CAPTURE_SG) {
+		if (pgn >= TW68_SG_ENTRIES)
+			return -EINVAL;
+		dev->video_dmaq[nId + 1].sg_count = pgn + 1;
+		dev->video_dmaq[nId + 1].sg_fieldsize = size / 2;
+		SGDMA_setup(dev, nId);	// page table DMA mode
+	} else
+		BFDMA_setup(dev, nId, (TW68_dma_lines(fh) / 2), TW68_dma_pitch(fh->fmt, fh->width),
+			    TW68_dma_pitch(fh->fmt, fh->width));	// BFbuf setup  DMA mode ...
 
 	dwReg2 = reg_readl(DMA_CH0_CONFIG + 2);
 	dwReg = reg_readl(DMA_CH0_CONFIG + nId);
 
-	if (0 == *count)
-		*count = gbuffers;
-
-	pgn = TW68_buffer_pages(*size / 2) - 1;	// page number for 1 field
-
-	while (*size * *count > VideoFrames_limit * 1024 * 1024 * 2)
-		(*count)--;
-
 	m_nDropChannelNum = 0;
 	m_bDropMasterOrSlave = 1;	/* master */
 	m_bDropField = 0;
 	m_bDropOddOrEven = 0;
-	m_bHorizontalDecimate = 0;
-	m_bVerticalDecimate = 0;
+	m_bHorizontalDecimate = !!(dec & TW68_DECIMATE_H);
+	m_bVerticalDecimate = !!(dec & TW68_DECIMATE_V);
 
 	m_StartIdx = ChannelOffset * nId;
 	m_EndIdx = m_StartIdx + pgn;	///pgn;  85 :: 720 * 480
@@ -649,15 +723,17 @@ int buffer_setup(struct videobuf_queue *q, unsigned int *count,
 	//////external video decoder settings//////
 
 	dwRegW = fh->width;
-	dwRegH = fh->height / 2;	// frame height
+	dwRegH = TW68_dma_lines(fh) / 2;	// frame height
 
 	dwReg = dwRegW | (dwRegH << 16) | (1 << 31);
 	dwRegW = dwRegH = dwReg;
 
-	//Video Size
-	reg_writel(VIDEO_SIZE_REG, dwReg);	//for Rev.A backward compatible
+	//Video Size, TW68_decoder_setup() left it for the decimation
+	if (!dec) {
+		reg_writel(VIDEO_SIZE_REG, dwReg);	//for Rev.A backward compatible
 
-	reg_writel(VIDEO_SIZE_REG0 + nId, dwReg);	//for Rev.B or later only
+		reg_writel(VIDEO_SIZE_REG0 + nId, dwReg);	//for Rev.B or later only
+	}
 
 	//Scaler
 	dwRegW &= 0x7FF;
@@ -684,7 +760,7 @@ int buffer_setup(struct videobuf_queue *q, unsigned int *count,
 	dwReg = (dwRegW - dwRegH) * (1 << 16) / fh->width;
 	dwReg = (dwRegH & 0x1F) | ((dwRegH & 0x3FF) << 5) | (dwReg << 15);
 
-	reg_writel(DROP_FIELD_REG0 + nId, 0xBFFFFFFF);	//28 // B 30 FPS
+	tw68v_set_framerate(dev, nId, dev->fps[nId + 1]);	// 0xBFFFFFFF: 30 FPS
 
 	dwReg2 = reg_readl(DMA_CH0_CONFIG + 2);
 	dwReg = reg_readl(DMA_CH0_CONFIG + nId);
@@ -692,33 +768,223 @@ int buffer_setup(struct videobuf_queue *q, unsigned int *count,
 	return 0;
 }
 
-static void buffer_queue(struct videobuf_queue *q, struct videobuf_buffer *vb)
+int buffer_setup(struct vb2_queue *q, const struct v4l2_format *fmt,
+		 unsigned int *count, unsigned int *num_planes,
+		 unsigned int sizes[], void *alloc_ctxs[])
 {
-	struct TW68_fh *fh = q->priv_data;
-	struct TW68_buf *buf = container_of(vb, struct TW68_buf, vb);
-	int nId = fh->DMA_nCH;
+	unsigned int nId;
+	struct TW68_dev *dev;
+	struct TW68_fh *fh = vb2_get_drv_priv(q);
+	unsigned int *size = &sizes[0];
 
-	if (nId == 0XF)
-		nId = 0;
-	else
-		nId++;
+	dev = fh->dev;
+
+	*num_planes = 1;
+	alloc_ctxs[0] = dev->alloc_ctx;
+
+	nId = fh->DMA_nCH;	// DMA channel
+
+	if (nId == 0XF) {
+		buffer_setup_QF(q, count, size);
+		return 0;
+	}
+
+	*size = fh->fmt->depth * fh->width * fh->height >> 3;	// calculate byte size for 1 frame
+
+	if (!fh->sub) {
+		struct TW68_dmaqueue *mq = &dev->video_dmaq[nId + 1];
 
-	TW68_buffer_queue(fh->dev, &fh->dev->video_dmaq[nId], buf);
+		mq->width = fh->width;
+		mq->height = TW68_dma_lines(fh);
+		mq->pitch = TW68_dma_pitch(fh->fmt, fh->width);
+	} else {
+		struct TW68_dmaqueue *sq = &dev->video_dmaq[TW68_SUB_NODE + nId];
+
+		sq->width = fh->width;
+		sq->height = TW68_dma_lines(fh);
+		sq->pitch = TW68_dma_pitch(fh->fmt, fh->width);
+		if (dev->video_opened & (1 << nId)) {
+			/* the main stream owns F1 and the channel setup */
+			if (dev->decimate[nId])
+				return -EBUSY;	// the DMA would halve F2 too
+			TW68_F2_setup(dev, nId);
+			if (0 == *count)
+				*count = gbuffers;
+			while (*size * *count > VideoFrames_limit * 1024 * 1024 * 2)
+				(*count)--;
+			return 0;
+		}
+		/* no main stream: set the channel up with the sub-stream size */
+	}
+
+	if (0 == *count)
+		*count = gbuffers;
+
+	while (*size * *count > VideoFrames_limit * 1024 * 1024 * 2)
+		(*count)--;
+
+	if (!fh->sub && (dev->streaming & (1 << (nId + 8)))) {
+		/* the sub-stream runs the channel, set it up at STREAMON */
+		if (fh->capture_mode != TW68_CAPTURE_SG &&
+		    PAGE_ALIGN(BD_frame_size(dev, nId)) > dev->BDbuf[nId][0].size)
+			return -EBUSY;
+		return 0;
+	}
 
+	return TW68_channel_setup(fh);
 }
 
-static void buffer_release(struct videobuf_queue *q, struct videobuf_buffer *vb)
+static void buffer_queue(struct vb2_buffer *vb)
 {
+	struct TW68_fh *fh = vb2_get_drv_priv(vb->vb2_queue);
+	struct TW68_dev *dev = fh->dev;
 	struct TW68_buf *buf = container_of(vb, struct TW68_buf, vb);
-	free_buffer(q, buf);
+	unsigned long flags;
+	int nId = TW68_qid(fh);
+
+	spin_lock_irqsave(&dev->slock, flags);
+	TW68_buffer_queue(dev, &dev->video_dmaq[nId], buf);
+	spin_unlock_irqrestore(&dev->slock, flags);
 
 }
 
-static struct videobuf_queue_ops video_qops = {
-	.buf_setup = buffer_setup,
+static int start_streaming(struct vb2_queue *q, unsigned int count)
+{
+	struct TW68_fh *fh = vb2_get_drv_priv(q);
+	struct TW68_dev *dev = fh->dev;
+	unsigned long flags;
+	u32 mine, other;
+	int err;
+
+// read dma config
+	if (fh->DMA_nCH == 0XF) {
+		dev->video_dmaq[TW68_qid(fh)].DMA_nCH = 0xF;	// mark in use
+		err = TW68_mosaic_start(dev->video_dmaq[TW68_qid(fh)].mosaic);
+		if (err)
+			goto fail;
+
+	} else {
+		/* main and sub-stream share the channel DMA, start it once */
+		mine = 1 << (fh->DMA_nCH + (fh->sub ? 8 : 0));
+		other = 1 << (fh->DMA_nCH + (fh->sub ? 0 : 8));
+
+		/* SG mode writes straight into the buffers, no BDbuf needed */
+		if (fh->capture_mode == TW68_CAPTURE_SG) {
+			err = SG_field_alloc(dev, fh->DMA_nCH,
+					     dev->video_dmaq[fh->DMA_nCH + 1].sg_fieldsize);
+			if (err)
+				goto fail;
+		} else {
+			err = BD_alloc(dev, fh->DMA_nCH,
+				       BD_frame_size(dev, fh->DMA_nCH));
+			if (err == -EBUSY)
+				printk(KERN_INFO
+				       "%s: channel %d runs a smaller format, stop it first\n",
+				       dev->name, fh->DMA_nCH);
+			if (err)
+				goto fail;
+		}
+
+		/* buffer_setup() left the channel to the running sub-stream */
+		if (!fh->sub && (dev->streaming & other)) {
+			err = TW68_channel_setup(fh);
+			if (err)
+				goto fail;
+			TW68_F2_setup(dev, fh->DMA_nCH);
+		}
+
+		spin_lock_irqsave(&dev->slock, flags);
+		dev->streaming |= mine;
+		spin_unlock_irqrestore(&dev->slock, flags);
+		if (fh->sub)
+			TW68_F2_setup(dev, fh->DMA_nCH);
+
+		if (fh->capture_mode == TW68_CAPTURE_CONTIG)
+			BD_Start(dev, fh->DMA_nCH);
+		else if (fh->capture_mode == TW68_CAPTURE_SG) {
+			err = SG_Start(dev, fh->DMA_nCH);
+			if (err) {
+				spin_lock_irqsave(&dev->slock, flags);
+				dev->streaming &= ~mine;
+				spin_unlock_irqrestore(&dev->slock, flags);
+				if (!(dev->streaming & other))
+					SG_field_free(dev, fh->DMA_nCH);
+				goto fail;
+			}
+		}
+		if (!(dev->streaming & other))
+			TW68_set_dmabits(dev, fh->DMA_nCH);
+	}
+
+	return 0;
+
+fail:
+	TW68_buffer_cancel(dev, &dev->video_dmaq[TW68_qid(fh)],
+			   VB2_BUF_STATE_QUEUED);
+	return err;
+}
+
+static void stop_streaming(struct vb2_queue *q)
+{
+	struct TW68_fh *fh = vb2_get_drv_priv(q);
+	struct TW68_dev *dev = fh->dev;
+	int DMA_nCH = fh->DMA_nCH;
+	unsigned long flags;
+	u32 mine, other;
+	int nId;
+
+	if (DMA_nCH == 0x0F) {
+		nId = TW68_qid(fh);
+		dev->video_fieldcount[nId] = 0;
+		TW68_mosaic_stop(dev->video_dmaq[nId].mosaic);
+		del_timer(&dev->video_dmaq[nId].timeout);
+	} else {
+		mine = 1 << (DMA_nCH + (fh->sub ? 8 : 0));
+		other = 1 << (DMA_nCH + (fh->sub ? 0 : 8));
+		nId = TW68_qid(fh);
+
+		spin_lock_irqsave(&dev->slock, flags);
+		dev->streaming &= ~mine;
+		spin_unlock_irqrestore(&dev->slock, flags);
+		if (!(dev->streaming & other)) {
+			dev->video_fieldcount[DMA_nCH + 1] = 0;
+			stop_video_DMA(dev, DMA_nCH);	//
+		}
+		del_timer(&dev->video_dmaq[nId].timeout);
+		/* no field events for this stream past this point */
+		synchronize_irq(dev->pci->irq);
+		flush_work(&dev->video_dmaq[DMA_nCH + 1].work);
+
+		if (fh->capture_mode == TW68_CAPTURE_CONTIG) {
+			if (!(dev->streaming & other))
+				BD_Release(dev, DMA_nCH, 0xF);
+			else
+				BD_Release(dev, DMA_nCH, fh->sub ? 0xC : 0x3);
+		} else if (fh->capture_mode == TW68_CAPTURE_SG) {
+			SG_Release(dev, DMA_nCH);
+			SG_field_free(dev, DMA_nCH);
+		}
+		if (!(dev->streaming & other))
+			BD_free(dev, DMA_nCH);
+
+		if (fh->sub && (dev->streaming & other)) {
+			/* F2 frames go back to the main stream */
+			TW68_F2_setup(dev, DMA_nCH);
+			if (fh->capture_mode == TW68_CAPTURE_CONTIG)
+				BD_Start(dev, DMA_nCH);
+		}
+	}
+
+	/* vb2 wants every buffer back before streaming may stop */
+	TW68_buffer_cancel(dev, &dev->video_dmaq[nId], VB2_BUF_STATE_ERROR);
+}
+
+static struct vb2_ops video_qops = {
+	.queue_setup = buffer_setup,
 	.buf_prepare = buffer_prepare,
 	.buf_queue = buffer_queue,
-	.buf_release = buffer_release,
+	.start_streaming = start_streaming,
+	.stop_streaming = stop_streaming,
 };
 
 /* ------------------------------------------------------------------ */
@@ -807,6 +1073,9 @@ int TW68_g_ctrl_internal(struct TW68_dev *dev, struct TW68_fh *fh,
 	case V4L2_CID_PRIVATE_AUTOMUTE:
 		c->value = dev->video_param[nId].ctl_automute;
 		break;
+	case V4L2_CID_PRIVATE_DEINTERLACE:
+		c->value = dev->video_param[nId].ctl_deinterlace;
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -945,6 +1214,10 @@ int TW68_s_ctrl_internal(struct TW68_dev *dev, struct TW68_fh *fh,
 			dev->video_param[nId].ctl_automute = c->value;
 			break;
 		}
+	case V4L2_CID_PRIVATE_DEINTERLACE:
+		/* read by the copy pass of the next frame */
+		dev->video_param[nId].ctl_deinterlace = c->value;
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -959,17 +1232,14 @@ static int TW68_s_ctrl(struct file *file, void *f, struct v4l2_control *c)
 	return TW68_s_ctrl_internal(fh->dev, fh, c);
 }
 
-static struct videobuf_queue *TW68_queue(struct TW68_fh *fh)
+static struct vb2_queue *TW68_queue(struct TW68_fh *fh)
 {
-	struct videobuf_queue *q = NULL;
+	struct vb2_queue *q = NULL;
 
 	switch (fh->type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
 		q = &fh->cap;
 		break;
-	case V4L2_BUF_TYPE_VBI_CAPTURE:
-		q = &fh->vbi;
-		break;
 	default:
 		BUG();
 	}
@@ -997,14 +1267,14 @@ static int video_open(struct file *file)
 	unsigned int request = 0;
 	unsigned int dmaCH;
 
-	int k;
+	int k, kc, qf, err;
 
 
 	mutex_lock(&TW686v_devlist_lock);
 
 	list_for_each_entry(dev, &TW686v_devlist, devlist) {
 
-		for (k = 0; k < 9; k++)	// 8 - 9
+		for (k = 0; k < TW68_NODES; k++)	// 8 - 9
 		{
 
 			if (dev->video_device[k]
@@ -1019,17 +1289,31 @@ static int video_open(struct file *file)
 	return -ENODEV;
 
 found:
-	mutex_unlock(&TW686v_devlist_lock);
-	if (k == 0)		// QF output
-		request = 0x0F;	// internal 4 decoders   mux QF
+	qf = (k == TW68_QF2_NODE);
+	if (k == 0 || qf)	// QF output, takes its tile channels when it streams
+		request = TW68_QF_OPENED(qf);
 	else
 		request = 1 << (k - 1);
 
 	// check video decoder video standard and change default tvnormf
 	dmaCH = 0xF;
-	if (k > 0)
+	kc = 0;			// per channel state index, the QF muxes share 0
+	if (qf || k == 0)
+		;
+	else if (k >= TW68_SUB_NODE)
+		dmaCH = k - TW68_SUB_NODE;
+	else
 		dmaCH = k - 1;
+	if (dmaCH != 0xF)
+		kc = dmaCH + 1;
+
+	/* a mosaic tile channel has no F2 frames to spare */
+	if (k >= TW68_SUB_NODE && !qf && dev->tile[dmaCH]) {
+		mutex_unlock(&TW686v_devlist_lock);
+		return -EBUSY;
+	}
 
+	/* the mosaic claims its tile channels under the same lock */
 	if (dev->video_opened & request) {
 		mutex_unlock(&TW686v_devlist_lock);
 		printk(" EBUSY    dev->video_opened %x  request %x \n",
@@ -1038,11 +1322,9 @@ found:
 	}
 
 	dev->video_opened = dev->video_opened | request;
+	mutex_unlock(&TW686v_devlist_lock);
 
-	if (k)
-		dev->video_dmaq[k].DMA_nCH = k - 1;
-	else
-		dev->video_dmaq[k].DMA_nCH = 0x0F;	// 0X0F;
+	dev->video_dmaq[k].DMA_nCH = dmaCH;	// 0X0F for QF
 
 	/* allocate + initialize per filehandle data */
 	fh = kzalloc(sizeof(*fh), GFP_KERNEL);
@@ -1050,34 +1332,58 @@ found:
 		return -ENOMEM;
 
 	if (VideoDecoderDetect(dev, dmaCH) == 50) {
-		dev->tvnormf[k] = &tvnorms[0];
-		dev->PAL50[k] = 1;
+		dev->tvnormf[kc] = &tvnorms[0];
+		dev->PAL50[kc] = 1;
 		fh->dW = PAL_default_width;
 		fh->dH = PAL_default_height;
 	} else {
-		dev->tvnormf[k] = &tvnorms[4];
-		dev->PAL50[k] = 0;
+		dev->tvnormf[kc] = &tvnorms[4];
+		dev->PAL50[kc] = 0;
 		fh->dW = NTSC_default_width;
 		fh->dH = NTSC_default_height;
 
 	}
+	if (dmaCH == 0xF)
+		dev->video_dmaq[k].mosaic->pal = dev->PAL50[kc];
 
 	file->private_data = fh;
 	fh->dev = dev;
 	fh->DMA_nCH = dev->video_dmaq[k].DMA_nCH;	///  k;    /// DMA index   +1
+	fh->sub = (k >= TW68_SUB_NODE && !qf);
+	fh->qf = qf;
 	fh->type = type;
 	fh->fmt = format_by_fourcc(V4L2_PIX_FMT_YUYV);	/// YUY2 by default
 	fh->width = fh->dW;	//704;  //720;
 	fh->height = fh->dH;	//576;
+	/* the QF mosaic is one contiguous frame, no page table DMA there */
+	fh->capture_mode = dev->capture_mode;
+	if (dmaCH == 0xF && fh->capture_mode == TW68_CAPTURE_SG)
+		fh->capture_mode = TW68_CAPTURE_COPY;
 
 	v4l2_prio_open(&dev->prio, &fh->prio);
 
-	videobuf_queue_vmalloc_init(&fh->cap, &video_qops,
-				    NULL, &dev->slock,
-				    V4L2_BUF_TYPE_VIDEO_CAPTURE,
-				    V4L2_FIELD_INTERLACED,
-				    sizeof(struct TW68_buf), fh
-				    , NULL);
+	/* page table DMA writes one field after the other */
+	fh->field = V4L2_FIELD_INTERLACED;
+	if (fh->capture_mode == TW68_CAPTURE_SG)
+		fh->field = V4L2_FIELD_SEQ_TB;
+
+	fh->cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fh->cap.io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_READ;
+	fh->cap.drv_priv = fh;
+	fh->cap.buf_struct_size = sizeof(struct TW68_buf);
+	fh->cap.ops = &video_qops;
+	fh->cap.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	fh->cap.mem_ops = TW68_vb_memops(fh->capture_mode);
+
+	err = vb2_queue_init(&fh->cap);
+	if (err < 0) {
+		mutex_lock(&TW686v_devlist_lock);
+		dev->video_opened &= ~request;
+		mutex_unlock(&TW686v_devlist_lock);
+		file->private_data = NULL;
+		kfree(fh);
+		return err;
+	}
 
 	return 0;
 }
@@ -1091,16 +1397,9 @@ video_read(struct file *file, char __user * data, size_t count, loff_t * ppos)
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
 		if (res_locked(fh, fh->dev, RESOURCE_VIDEO))
 			return -EBUSY;
-		return videobuf_read_one(TW68_queue(fh),
-					 data, count, ppos,
-					 file->f_flags & O_NONBLOCK);
-	case V4L2_BUF_TYPE_VBI_CAPTURE:
-		if (!res_get(fh->dev, fh, RESOURCE_VBI))
-			return -EBUSY;
-		return videobuf_read_stream(TW68_queue(fh),
-					    data, count, ppos, 1,
-					    file->f_flags & O_NONBLOCK);
-		break;
+		return vb2_read(TW68_queue(fh),
+				data, count, ppos,
+				file->f_flags & O_NONBLOCK);
 	default:
 		BUG();
 		return 0;
@@ -1111,49 +1410,15 @@ static unsigned int
 video_poll(struct file *file, struct poll_table_struct *wait)
 {
 	struct TW68_fh *fh = file->private_data;
-	struct videobuf_buffer *buf = NULL;
-	unsigned int rc = 0;
 
 	if (V4L2_BUF_TYPE_VIDEO_CAPTURE != fh->type)
 		return POLLERR;
 
-	if (V4L2_BUF_TYPE_VBI_CAPTURE == fh->type)
-		return videobuf_poll_stream(file, &fh->vbi, wait);
-
-	if (res_check(fh, RESOURCE_VIDEO)) {
-		if (!list_empty(&fh->cap.stream))
-			buf =
-			    list_entry(fh->cap.stream.next,
-				       struct videobuf_buffer, stream);
-	} else {
-		mutex_lock(&fh->cap.vb_lock);
-		if (UNSET == fh->cap.read_off) {
-			/* need to capture a new frame */
-			if (res_locked(fh, fh->dev, RESOURCE_VIDEO))
-				goto err;
-			if (0 !=
-			    fh->cap.ops->buf_prepare(&fh->cap, fh->cap.read_buf,
-						     fh->cap.field))
-				goto err;
-			fh->cap.ops->buf_queue(&fh->cap, fh->cap.read_buf);
-			fh->cap.read_off = 0;
-		}
-		mutex_unlock(&fh->cap.vb_lock);
-		buf = fh->cap.read_buf;
-	}
-
-	if (!buf)
-		goto err;
-
-	poll_wait(file, &buf->done, wait);
-	if (buf->state == VIDEOBUF_DONE || buf->state == VIDEOBUF_ERROR)
-		rc = POLLIN | POLLRDNORM;
-	mutex_unlock(&fh->cap.vb_lock);
-	return rc;
+	if (!res_check(fh, RESOURCE_VIDEO) &&
+	    res_locked(fh, fh->dev, RESOURCE_VIDEO))
+		return POLLERR;
 
-err:
-	mutex_unlock(&fh->cap.vb_lock);
-	return POLLERR;
+	return vb2_poll(&fh->cap, file, wait);
 }
 
 static int video_release(struct file *file)
@@ -1161,39 +1426,30 @@ static int video_release(struct file *file)
 	struct TW68_fh *fh = file->private_data;
 	struct TW68_dev *dev = fh->dev;
 	int DMA_nCH = fh->DMA_nCH;
-	int nId = DMA_nCH + 1;
+	int nId = TW68_qid(fh);
+
+	/* stops the stream first if it is still running */
+	vb2_queue_release(&fh->cap);
+	res_free(fh, res_check(fh, RESOURCE_VIDEO));
 
 	if (DMA_nCH == 0x0F) {
-		dev->video_opened &= ~(DMA_nCH);
-		dev->video_dmaq[0].DMA_nCH = 0;
-		dev->video_fieldcount[0] = 0;
-		stop_video_DMA(dev, 0);	//
-		stop_video_DMA(dev, 1);	//
-		stop_video_DMA(dev, 2);	//
-		stop_video_DMA(dev, 3);	//
-
-		dev->video_fieldcount[0] = 0;
-		stop_video_DMA(dev, 0);	//
-		del_timer(&dev->video_dmaq[0].timeout);
+		mutex_lock(&TW686v_devlist_lock);
+		dev->video_opened &= ~TW68_QF_OPENED(fh->qf);
+		mutex_unlock(&TW686v_devlist_lock);
+		dev->video_dmaq[nId].DMA_nCH = 0;
+		dev->video_fieldcount[nId] = 0;
+		del_timer(&dev->video_dmaq[nId].timeout);
 
 	} else {
-		dev->video_opened &= ~(1 << DMA_nCH);	/// set opened flag free
-		stop_video_DMA(dev, DMA_nCH);	//  fh->DMA_nCH  = DMA ID
+		mutex_lock(&TW686v_devlist_lock);
+		dev->video_opened &= ~(1 << (nId - 1));	/// set opened flag free
+		mutex_unlock(&TW686v_devlist_lock);
 		dev->video_dmaq[nId].DMA_nCH = 0;
 		dev->video_fieldcount[nId] = 0;
 		del_timer(&dev->video_dmaq[nId].timeout);
 
 	}
 
-
-
-	videobuf_streamoff(&fh->cap);
-
-	if (fh->cap.read_buf) {
-		buffer_release(&fh->cap, fh->cap.read_buf);
-		kfree(fh->cap.read_buf);
-	}
-
 	file->private_data = NULL;
 
 	kfree(fh);
@@ -1204,7 +1460,7 @@ static int video_release(struct file *file)
 static int video_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct TW68_fh *fh = file->private_data;
-	return videobuf_mmap_mapper(TW68_queue(fh), vma);
+	return vb2_mmap(TW68_queue(fh), vma);
 }
 
 /* ------------------------------------------------------------------ */
@@ -1235,10 +1491,11 @@ static int TW68_g_fmt_vid_cap(struct file *file, void *priv,
 	struct TW68_fh *fh = priv;
 	f->fmt.pix.width = fh->width;
 	f->fmt.pix.height = fh->height;
-	f->fmt.pix.field = fh->cap.field;
+	f->fmt.pix.field = fh->field;
 	f->fmt.pix.pixelformat = fh->fmt->fourcc;
-	f->fmt.pix.bytesperline = (f->fmt.pix.width * fh->fmt->depth) >> 3;
-	f->fmt.pix.sizeimage = f->fmt.pix.height * f->fmt.pix.bytesperline;
+	f->fmt.pix.bytesperline = TW68_bytesperline(fh->fmt, f->fmt.pix.width);
+	f->fmt.pix.sizeimage =
+	    (f->fmt.pix.width * f->fmt.pix.height * fh->fmt->depth) >> 3;
 	f->fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
 	return 0;
 }
@@ -1256,39 +1513,19 @@ static int TW68_try_fmt_vid_cap(struct file *file, void *priv,
 
 	fmt = format_by_fourcc(f->fmt.pix.pixelformat);
 
-	if (NULL == fmt) {
+	if (NULL == fmt || !format_usable(fh, fmt)) {
 		printk("TW68 fmt:: no valid pixel format \n");
 
 		return -EINVAL;
 	}
 
-	if ((V4L2_PIX_FMT_YUYV) != fmt->fourcc) {
-		if ((V4L2_PIX_FMT_UYVY) != fmt->fourcc)	/// Only allow UYVY  0727))
-		{
-			printk("TW68 fmt:: not YUV422! \n");
-
-			return -EINVAL;
-		} else {
-			if (nId < 8)
-				dev->nVideoFormat[nId] = VIDEO_FORMAT_UYVY;
-			else {
-				dev->nVideoFormat[0] = VIDEO_FORMAT_UYVY;
-				dev->nVideoFormat[1] = VIDEO_FORMAT_UYVY;
-				dev->nVideoFormat[2] = VIDEO_FORMAT_UYVY;
-				dev->nVideoFormat[3] = VIDEO_FORMAT_UYVY;
-			}
-
-		}
-	} else {
-		if (nId < 8)
-			dev->nVideoFormat[nId] = VIDEO_FORMAT_YUYV;
-		else {
-			dev->nVideoFormat[0] = VIDEO_FORMAT_YUYV;
-			dev->nVideoFormat[1] = VIDEO_FORMAT_YUYV;
-			dev->nVideoFormat[2] = VIDEO_FORMAT_YUYV;
-			dev->nVideoFormat[3] = VIDEO_FORMAT_YUYV;
-		}
-
+	if (nId < 8)
+		dev->nVideoFormat[nId] = fmt->vf;
+	else {
+		dev->nVideoFormat[0] = fmt->vf;
+		dev->nVideoFormat[1] = fmt->vf;
+		dev->nVideoFormat[2] = fmt->vf;
+		dev->nVideoFormat[3] = fmt->vf;
 	}
 
 	if (nId > 8)
@@ -1304,12 +1541,33 @@ static int TW68_try_fmt_vid_cap(struct file *file, void *priv,
 		maxh = 576;
 	}
 
+	/* the scaler only shrinks, a channel's picture fits its crop */
+	if (nId < 8) {
+		struct v4l2_rect r;
+
+		TW68_crop_window(dev, nId, &r);
+		maxw = min_t(unsigned int, maxw, r.width);
+		maxh = min_t(unsigned int, maxh, r.height);
+	}
+
 	field = f->fmt.pix.field;
 
 	if (V4L2_FIELD_ANY == field) {
 		field = (f->fmt.pix.height > maxh / 2)
 		    ? V4L2_FIELD_INTERLACED : V4L2_FIELD_BOTTOM;
 	}
+	/* single fields and progressive frames come from the copy pass */
+	if ((fh->capture_mode != TW68_CAPTURE_COPY || nId == 0xF) &&
+	    (TW68_field_single(field) || V4L2_FIELD_NONE == field))
+		field = V4L2_FIELD_INTERLACED;
+	/* the deinterlacers average bytes, which only fits packed YUV */
+	if (V4L2_FIELD_NONE == field && (!fmt->yuv || fmt->convert))
+		field = V4L2_FIELD_INTERLACED;
+	/* page table DMA writes one field after the other */
+	if (fh->capture_mode == TW68_CAPTURE_SG &&
+	    V4L2_FIELD_INTERLACED == field)
+		field = V4L2_FIELD_SEQ_TB;
+
 	switch (field) {
 	case V4L2_FIELD_TOP:
 	case V4L2_FIELD_BOTTOM:
@@ -1317,6 +1575,8 @@ static int TW68_try_fmt_vid_cap(struct file *file, void *priv,
 		maxh = maxh / 2;
 		break;
 	case V4L2_FIELD_INTERLACED:
+	case V4L2_FIELD_SEQ_TB:
+	case V4L2_FIELD_NONE:
 		break;
 	default:
 		return -EINVAL;
@@ -1324,11 +1584,15 @@ static int TW68_try_fmt_vid_cap(struct file *file, void *priv,
 
 	f->fmt.pix.field = field;
 
-	v4l_bound_align_image(&f->fmt.pix.width, 128, maxw, 2,	// 4 pixel  test 360  4,
-			      &f->fmt.pix.height, 60, maxh, 0, 0);
+	/* any size the scalers make, down to TW68_MIN_WIDTH x TW68_MIN_HEIGHT */
+	v4l_bound_align_image(&f->fmt.pix.width, TW68_MIN_WIDTH, maxw,
+			      TW68_walign(fh, fmt),
+			      &f->fmt.pix.height, TW68_MIN_HEIGHT, maxh,
+			      TW68_halign(fh, fmt), 0);
 
-	f->fmt.pix.bytesperline = (f->fmt.pix.width * fmt->depth) >> 3;
-	f->fmt.pix.sizeimage = f->fmt.pix.height * f->fmt.pix.bytesperline;
+	f->fmt.pix.bytesperline = TW68_bytesperline(fmt, f->fmt.pix.width);
+	f->fmt.pix.sizeimage =
+	    (f->fmt.pix.width * f->fmt.pix.height * fmt->depth) >> 3;
 
 	return 0;
 }
@@ -1346,7 +1610,7 @@ static int TW68_s_fmt_vid_cap(struct file *file, void *priv,
 	fh->fmt = format_by_fourcc(f->fmt.pix.pixelformat);
 	fh->width = f->fmt.pix.width;
 	fh->height = f->fmt.pix.height;
-	fh->cap.field = f->fmt.pix.field;
+	fh->field = f->fmt.pix.field;
 
 	return 0;
 }
@@ -1364,7 +1628,11 @@ int TW68_queryctrl(struct file *file, void *priv, struct v4l2_queryctrl *c)
 
 int TW68_querymenu(struct file *file, void *priv, struct v4l2_querymenu *c)
 {
-	return -EINVAL;
+	if (c->id != V4L2_CID_PRIVATE_DEINTERLACE ||
+	    c->index >= ARRAY_SIZE(deinterlace_menu))
+		return -EINVAL;
+	strlcpy(c->name, deinterlace_menu[c->index], sizeof(c->name));
+	return 0;
 }
 
 ///EXPORT_SYMBOL_GPL(TW68_queryctrl);
@@ -1521,6 +1789,88 @@ static int TW68_g_std(struct file *file, void *priv, v4l2_std_id * id)
 	return 0;
 }
 
+static int TW68_g_parm(struct file *file, void *priv,
+		       struct v4l2_streamparm *sp)
+{
+	struct TW68_fh *fh = priv;
+	struct TW68_dev *dev = fh->dev;
+	struct v4l2_captureparm *cp = &sp->parm.capture;
+	unsigned int fps, pal;
+
+	if (sp->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	if (fh->DMA_nCH == 0XF) {
+		struct TW68_mosaic *m = dev->video_dmaq[TW68_qid(fh)].mosaic;
+
+		fps = m->fps;
+		pal = m->pal;
+	} else {
+		fps = dev->fps[fh->DMA_nCH + 1];
+		pal = dev->PAL50[fh->DMA_nCH + 1];
+	}
+	if (fps == 0)
+		fps = pal ? 25 : 30;
+
+	memset(cp, 0, sizeof(*cp));
+	cp->capability = V4L2_CAP_TIMEPERFRAME;
+	cp->readbuffers = gbuffers;
+	if (pal) {
+		cp->timeperframe.numerator = 1;
+		cp->timeperframe.denominator = fps;
+	} else {
+		cp->timeperframe.numerator = 1001;
+		cp->timeperframe.denominator = fps * 1000;
+	}
+
+	return 0;
+}
+
+/* timeperframe is met by DROP_FIELD_REG, see tw68v_set_framerate() */
+static int TW68_s_parm(struct file *file, void *priv,
+		       struct v4l2_streamparm *sp)
+{
+	struct TW68_fh *fh = priv;
+	struct TW68_dev *dev = fh->dev;
+	struct v4l2_fract *tpf = &sp->parm.capture.timeperframe;
+	struct TW68_mosaic *m = NULL;
+	struct TW68_tile *t;
+	unsigned int k, fps, max;
+
+	if (sp->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	if (fh->DMA_nCH == 0XF) {
+		m = dev->video_dmaq[TW68_qid(fh)].mosaic;
+		max = m->pal ? 25 : 30;
+	} else
+		max = dev->PAL50[fh->DMA_nCH + 1] ? 25 : 30;
+
+	fps = 0;		// full rate
+	if (tpf->numerator && tpf->denominator) {
+		fps = DIV_ROUND_CLOSEST(tpf->denominator, tpf->numerator);
+		fps = clamp_t(unsigned int, fps, 1, max);
+		if (fps == max)
+			fps = 0;
+	}
+	if (m) {
+		/* the tiles of a streaming mosaic, on whichever board */
+		mutex_lock(&TW686v_devlist_lock);
+		m->fps = fps;
+		for (k = 0; k < m->ntiles; k++) {
+			t = &m->tile[k];
+			if (t->src)
+				tw68v_set_framerate(t->src, t->ch, fps);
+		}
+		mutex_unlock(&TW686v_devlist_lock);
+	} else {
+		dev->fps[fh->DMA_nCH + 1] = fps;
+		tw68v_set_framerate(dev, fh->DMA_nCH, fps);
+	}
+
+	return TW68_g_parm(file, priv, sp);
+}
+
 static int TW68_cropcap(struct file *file, void *priv, struct v4l2_cropcap *cap)
 {
 	struct TW68_fh *fh = priv;
@@ -1530,8 +1880,8 @@ static int TW68_cropcap(struct file *file, void *priv, struct v4l2_cropcap *cap)
 	    cap->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
-	cap->bounds = dev->crop_bounds;
-	cap->defrect = dev->crop_defrect;
+	TW68_crop_bounds(fh, &cap->bounds);
+	cap->defrect = cap->bounds;
 	cap->pixelaspect.numerator = 1;
 	cap->pixelaspect.denominator = 1;
 
@@ -1547,54 +1897,158 @@ static int TW68_cropcap(struct file *file, void *priv, struct v4l2_cropcap *cap)
 	return 0;
 }
 
-static int TW68_g_crop(struct file *file, void *f, struct v4l2_crop *crop)
+/* largest picture of a node: its channel's crop, the scalers only shrink */
+static void TW68_compose_bounds(struct TW68_fh *fh, struct v4l2_rect *r)
 {
-	struct TW68_fh *fh = f;
-	struct TW68_dev *dev = fh->dev;
+	if (fh->DMA_nCH == 0xF)
+		TW68_crop_bounds(fh, r);
+	else
+		TW68_crop_window(fh->dev, fh->DMA_nCH, r);
+	r->left = 0;
+	r->top = 0;
+	if (TW68_field_single(fh->field))
+		r->height /= 2;
+}
 
-	if (crop->type != V4L2_BUF_TYPE_VIDEO_CAPTURE &&
-	    crop->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
+/*
+ * G/S_CROP are emulated by the v4l2 core through the selection ioctls.
+ * The crop reads back as it was set; the part of it the scaler samples
+ * for the current format, after rounding its scale factors down, is the
+ * read-only TW68_SEL_TGT_SAMPLED.
+ */
+static int TW68_g_selection(struct file *file, void *priv,
+			    struct v4l2_selection *s)
+{
+	struct TW68_fh *fh = priv;
+
+	if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
-	crop->c = dev->crop_current;
+
+	switch (s->target) {
+	case TW68_SEL_TGT_SAMPLED:
+		if (fh->DMA_nCH != 0xF) {
+			TW68_scaler_window(fh->dev, fh->DMA_nCH,
+					   TW68_dma_lines(fh) / 2, fh->width,
+					   &s->r);
+			break;
+		}
+		TW68_crop_bounds(fh, &s->r);
+		break;
+	case V4L2_SEL_TGT_CROP:
+		if (fh->DMA_nCH != 0xF) {
+			TW68_crop_window(fh->dev, fh->DMA_nCH, &s->r);
+			break;
+		}
+		/* fall through, the mosaic is cropped through its channels */
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		TW68_crop_bounds(fh, &s->r);
+		break;
+	case V4L2_SEL_TGT_COMPOSE:
+		s->r.left = 0;
+		s->r.top = 0;
+		s->r.width = fh->width;
+		s->r.height = fh->height;
+		break;
+	case V4L2_SEL_TGT_COMPOSE_DEFAULT:
+	case V4L2_SEL_TGT_COMPOSE_BOUNDS:
+		TW68_compose_bounds(fh, &s->r);
+		break;
+	default:
+		return -EINVAL;
+	}
 	return 0;
 }
 
-static int TW68_s_crop(struct file *file, void *f,
-		       const struct v4l2_crop *crop_p)
+/*
+ * Crop a channel in the decoder (CROP_H, VDELAY, VACTIVE, HDELAY,
+ * HACTIVE), so only the window is scaled and transferred.  Main and
+ * sub-stream share the window; it also applies to the channel's mosaic
+ * tile.  The format shrinks to fit, the scaler cannot enlarge.
+ */
+static int TW68_s_crop_selection(struct TW68_fh *fh, struct v4l2_rect *sr)
 {
-	struct TW68_fh *fh = f;
 	struct TW68_dev *dev = fh->dev;
-	struct v4l2_rect *b = &dev->crop_bounds;
-	struct v4l2_crop crop = *crop_p;
+	struct v4l2_rect b, r = *sr;
+	int nId = fh->DMA_nCH;
 
-	if (crop.type != V4L2_BUF_TYPE_VIDEO_CAPTURE &&
-	    crop.type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
+	if (nId == 0xF)
 		return -EINVAL;
-	if (crop.c.height < 0)
+	if ((dev->streaming & (0x101 << nId)) || dev->tile[nId])
+		return -EBUSY;
+
+	/* whole pixel pairs and frame line pairs (one line per field) */
+	TW68_crop_bounds(fh, &b);
+	r.width = clamp_t(int, r.width, TW68_MIN_WIDTH, b.width) & ~1;
+	r.height = clamp_t(int, r.height, TW68_MIN_HEIGHT * 2, b.height) & ~1;
+	r.left = clamp_t(int, r.left, 0, b.width - r.width) & ~1;
+	r.top = clamp_t(int, r.top, 0, b.height - r.height) & ~1;
+
+	mutex_lock(&dev->lock);
+	dev->crop[nId] = r;
+	mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/*
+ * The compose rectangle is the picture the hardware scales to, so it is
+ * the format size; setting it only changes the size.
+ */
+static int TW68_s_selection(struct file *file, void *priv,
+			    struct v4l2_selection *s)
+{
+	struct TW68_fh *fh = priv;
+	struct v4l2_format f;
+	int err;
+
+	if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
-	if (crop.c.width < 0)
+	if (s->target != V4L2_SEL_TGT_CROP && s->target != V4L2_SEL_TGT_COMPOSE)
 		return -EINVAL;
-
-	if (res_locked(fh, fh->dev, RESOURCE_OVERLAY))
-		return -EBUSY;
-	if (res_locked(fh, fh->dev, RESOURCE_VIDEO))
+	if (vb2_is_busy(TW68_queue(fh)))
 		return -EBUSY;
 
-	if (crop.c.top < b->top)
-		crop.c.top = b->top;
-	if (crop.c.top > b->top + b->height)
-		crop.c.top = b->top + b->height;
-	if (crop.c.height > b->top - crop.c.top + b->height)
-		crop.c.height = b->top - crop.c.top + b->height;
-
-	if (crop.c.left < b->left)
-		crop.c.left = b->left;
-	if (crop.c.left > b->left + b->width)
-		crop.c.left = b->left + b->width;
-	if (crop.c.width > b->left - crop.c.left + b->width)
-		crop.c.width = b->left - crop.c.left + b->width;
-
-	dev->crop_current = crop.c;
+	f.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	TW68_g_fmt_vid_cap(file, priv, &f);
+	if (s->target == V4L2_SEL_TGT_CROP) {
+		err = TW68_s_crop_selection(fh, &s->r);
+		if (err)
+			return err;
+	} else {
+		f.fmt.pix.width = s->r.width;
+		f.fmt.pix.height = s->r.height;
+	}
+	err = TW68_s_fmt_vid_cap(file, priv, &f);
+	if (err)
+		return err;
+
+	return TW68_g_selection(file, priv, s);
+}
+
+/* any size from TW68_MIN_WIDTH x TW68_MIN_HEIGHT up to the crop */
+static int TW68_enum_framesizes(struct file *file, void *priv,
+				struct v4l2_frmsizeenum *fsize)
+{
+	struct TW68_fh *fh = priv;
+	struct TW68_format *fmt = format_by_fourcc(fsize->pixel_format);
+	struct v4l2_rect r;
+	unsigned int wstep, hstep;
+
+	if (fsize->index || NULL == fmt || !format_usable(fh, fmt))
+		return -EINVAL;
+
+	/* sizes of the current field order */
+	TW68_compose_bounds(fh, &r);
+	wstep = 1 << TW68_walign(fh, fmt);
+	hstep = 1 << TW68_halign(fh, fmt);
+
+	fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+	fsize->stepwise.min_width = TW68_MIN_WIDTH;
+	fsize->stepwise.max_width = r.width & ~(wstep - 1);
+	fsize->stepwise.step_width = wstep;
+	fsize->stepwise.min_height = TW68_MIN_HEIGHT;
+	fsize->stepwise.max_height = r.height & ~(hstep - 1);
+	fsize->stepwise.step_height = hstep;
 	return 0;
 }
 
@@ -1613,93 +2067,82 @@ static int TW68_s_audio(struct file *file, void *priv,
 static int TW68_enum_fmt_vid_cap(struct file *file, void *priv,
 				 struct v4l2_fmtdesc *f)
 {
+	struct TW68_fh *fh = priv;
+	unsigned int i, n = 0;
 
-	if (f->index >= FORMATS)
+	for (i = 0; i < FORMATS; i++) {
+		if (!format_usable(fh, &formats[i]))
+			continue;
+		if (n++ == f->index)
+			break;
+	}
+	if (i >= FORMATS)
 		return -EINVAL;
 
-	strlcpy(f->description, formats[f->index].name, sizeof(f->description));
+	strlcpy(f->description, formats[i].name, sizeof(f->description));
 
-	f->pixelformat = formats[f->index].fourcc;
+	f->pixelformat = formats[i].fourcc;
 
 	return 0;
 }
 
-#ifdef CONFIG_VIDEO_V4L1_COMPAT
-static int vidiocgmbuf(struct file *file, void *priv, struct video_mbuf *mbuf)
-{
-	struct TW68_fh *fh = file->private_data;
-	return videobuf_cgmbuf(TW68_queue(fh), mbuf, 8);
-}
-#endif
-
 static int TW68_reqbufs(struct file *file, void *priv,
 			struct v4l2_requestbuffers *p)
 {
 	struct TW68_fh *fh = priv;
-	return videobuf_reqbufs(TW68_queue(fh), p);
+	return vb2_reqbufs(TW68_queue(fh), p);
 }
 
 static int TW68_querybuf(struct file *file, void *priv, struct v4l2_buffer *b)
 {
 	struct TW68_fh *fh = priv;
-	return videobuf_querybuf(TW68_queue(fh), b);
+	return vb2_querybuf(TW68_queue(fh), b);
 }
 
 static int TW68_qbuf(struct file *file, void *priv, struct v4l2_buffer *b)
 {
 	struct TW68_fh *fh = priv;
 
-	struct videobuf_queue *q = NULL;
+	struct vb2_queue *q = NULL;
 	q = TW68_queue(fh);
 
-	return videobuf_qbuf(q, b);
+	return vb2_qbuf(q, b);
 }
 
 static int TW68_dqbuf(struct file *file, void *priv, struct v4l2_buffer *b)
 {
 	struct TW68_fh *fh = priv;
 
-	struct videobuf_queue *q = NULL;
+	struct vb2_queue *q = NULL;
 	q = &fh->cap;
 
-	return videobuf_dqbuf(q, b, file->f_flags & O_NONBLOCK);
+	return vb2_dqbuf(q, b, file->f_flags & O_NONBLOCK);
+}
+
+static int TW68_expbuf(struct file *file, void *priv,
+		       struct v4l2_exportbuffer *e)
+{
+	struct TW68_fh *fh = priv;
+	return vb2_expbuf(TW68_queue(fh), e);
 }
 
 static int TW68_streamon(struct file *file, void *priv, enum v4l2_buf_type type)
 {
 	struct TW68_fh *fh = priv;
 	struct TW68_dev *dev = fh->dev;
-	struct videobuf_queue *q;
 	int res = TW68_resource(fh);
-	int streaming;
-	u32 nId;
+	int err;
 
 	if (!res_get(dev, fh, res)) {
 		return -EBUSY;
 	}
 
-	nId = fh->DMA_nCH;
-	if (nId == 0XF)
-		nId = 0;
-
-	q = TW68_queue(fh);
-
-
-	streaming = videobuf_streamon(q);
-
-// read dma config  
-	if (fh->DMA_nCH == 0XF) {
-		dev->video_dmaq[0].DMA_nCH = 0xF;
-		dev->video_dmaq[0].DMA_nCH = 0xF;	// mark in use
-
-		dev->video_DMA_1st_started += 4;	//++
-		dev->videoCap_ID |= 0xF;
-		dev->videoDMA_ID |= 0xF;
+	/* DMA is started from start_streaming() once vb2 has buffers */
+	err = vb2_streamon(TW68_queue(fh), type);
+	if (err < 0)
+		res_free(fh, res);
 
-	} else
-		TW68_set_dmabits(dev, fh->DMA_nCH);
-
-	return streaming;
+	return err;
 }
 
 static int TW68_streamoff(struct file *file, void *priv,
@@ -1707,37 +2150,13 @@ static int TW68_streamoff(struct file *file, void *priv,
 {
 	int err;
 	struct TW68_fh *fh = priv;
-	struct TW68_dev *dev = fh->dev;
-	int DMA_nCH = fh->DMA_nCH;
-	int nId = DMA_nCH + 1;
-	struct videobuf_queue *q;
 	int res = TW68_resource(fh);
-	q = TW68_queue(fh);
-
-	if (DMA_nCH == 0x0F) {
-		dev->video_fieldcount[0] = 0;
-		stop_video_DMA(dev, 0);	//
-		stop_video_DMA(dev, 1);	//
-		stop_video_DMA(dev, 2);	//
-		stop_video_DMA(dev, 3);	//
-
-		dev->video_fieldcount[0] = 0;
-		stop_video_DMA(dev, 0);	//
-		del_timer(&dev->video_dmaq[0].timeout);
-	} else {
-		nId = DMA_nCH + 1;
-		dev->video_fieldcount[nId] = 0;
-		stop_video_DMA(dev, DMA_nCH);	//
-		del_timer(&dev->video_dmaq[nId].timeout);
-	}
-
 
-	stop_video_DMA(dev, fh->DMA_nCH);
-
-	err = videobuf_streamoff(q);
+	/* stop_streaming() halts the DMA and returns the buffers */
+	err = vb2_streamoff(TW68_queue(fh), type);
 	res_free(fh, res);
 
-	return 0;
+	return err;
 }
 
 static const struct v4l2_file_operations video_fops = {
@@ -1755,6 +2174,7 @@ static const struct v4l2_ioctl_ops video_ioctl_ops = {
 	.vidioc_enum_fmt_vid_cap = TW68_enum_fmt_vid_cap,
 	.vidioc_g_fmt_vid_cap = TW68_g_fmt_vid_cap,
 	.vidioc_try_fmt_vid_cap = TW68_try_fmt_vid_cap,
+	.vidioc_enum_framesizes = TW68_enum_framesizes,
 	.vidioc_s_fmt_vid_cap = TW68_s_fmt_vid_cap,
 	.vidioc_g_fmt_vbi_cap = TW68_try_get_set_fmt_vbi_cap,
 	.vidioc_try_fmt_vbi_cap = TW68_try_get_set_fmt_vbi_cap,
@@ -1766,8 +2186,11 @@ static const struct v4l2_ioctl_ops video_ioctl_ops = {
 	.vidioc_querybuf = TW68_querybuf,
 	.vidioc_qbuf = TW68_qbuf,
 	.vidioc_dqbuf = TW68_dqbuf,
+	.vidioc_expbuf = TW68_expbuf,
 	.vidioc_s_std = TW68_s_std,
 	.vidioc_g_std = TW68_g_std,
+	.vidioc_g_parm = TW68_g_parm,
+	.vidioc_s_parm = TW68_s_parm,
 	.vidioc_enum_input = TW68_enum_input,
 	.vidioc_g_input = TW68_g_input,
 	.vidioc_s_input = TW68_s_input,
@@ -1777,11 +2200,8 @@ static const struct v4l2_ioctl_ops video_ioctl_ops = {
 	.vidioc_s_ctrl = TW68_s_ctrl,
 	.vidioc_streamon = TW68_streamon,
 	.vidioc_streamoff = TW68_streamoff,
-#ifdef CONFIG_VIDEO_V4L1_COMPAT
-	.vidiocgmbuf = vidiocgmbuf,
-#endif
-	.vidioc_g_crop = TW68_g_crop,
-	.vidioc_s_crop = TW68_s_crop,
+	.vidioc_g_selection = TW68_g_selection,
+	.vidioc_s_selection = TW68_s_selection,
 #ifdef CONFIG_VIDEO_ADV_DEBUG
 	.vidioc_g_register = vidioc_g_register,
 	.vidioc_s_register = vidioc_s_register,
@@ -1801,25 +2221,32 @@ struct video_device TW68_video_template = {
 
 int TW68_video_init1(struct TW68_dev *dev)
 {
-	int k, m, n;
-	__le32 *cpu;
-	dma_addr_t dma_addr;
+	int k;
 	/* sanitycheck insmod options */
 	if (gbuffers < 2 || gbuffers > VIDEO_MAX_FRAME)
 		gbuffers = 2;
 	if (gbufsize < 0 || gbufsize > gbufsize_max)
 		gbufsize = gbufsize_max;
 	gbufsize = (gbufsize + PAGE_SIZE - 1) & PAGE_MASK;
+	if (capture_mode > TW68_CAPTURE_SG)
+		capture_mode = TW68_CAPTURE_COPY;
+	dev->capture_mode = capture_mode;
+
+	/* the vb2 allocator context ties capture buffers to the PCI device */
+	dev->alloc_ctx = NULL;
+	if (dev->capture_mode == TW68_CAPTURE_CONTIG)
+		dev->alloc_ctx = vb2_dma_contig_init_ctx(&dev->pci->dev);
+	else if (dev->capture_mode == TW68_CAPTURE_SG)
+		dev->alloc_ctx = vb2_dma_sg_init_ctx(&dev->pci->dev);
+	if (IS_ERR(dev->alloc_ctx)) {
+		printk(KERN_WARNING
+		       "%s: no DMA allocator context, capture_mode=0 used\n",
+		       dev->name);
+		dev->alloc_ctx = NULL;
+		dev->capture_mode = TW68_CAPTURE_COPY;
+	}
 
-// pci_alloc_consistent   32 4 * 8  continuous field memory buffer
-
-	for (n = 0; n < 8; n++)
-		for (m = 0; m < 4; m++) {
-			cpu = pci_alloc_consistent(dev->pci, 800 * 600 * 2, &dma_addr);	// 8* 4096 contiguous  //*2
-			dev->BDbuf[n][m].cpu = cpu;
-			dev->BDbuf[n][m].dma_addr = dma_addr;
-			// assume aways successful   480k each field   total 32  <16MB
-		}
+	/* BDbuf frames are allocated at STREAMON, see BD_alloc() */
 
 	/* put some sensible defaults into the data structures ... */
 	dev->ctl_bright = ctrl_by_id(V4L2_CID_BRIGHTNESS)->default_value;
@@ -1842,7 +2269,7 @@ int TW68_video_init1(struct TW68_dev *dev)
 
 	////////////////////////////////////////////////////////xxxxxxxxxxx
 
-	for (k = 0; k < 9; k++) {
+	for (k = 0; k < TW68_NODES; k++) {
 		INIT_LIST_HEAD(&dev->video_dmaq[k].queued);
 
 		INIT_LIST_HEAD(&dev->video_dmaq[k].active);
@@ -1904,6 +2331,18 @@ int TW68_video_init1(struct TW68_dev *dev)
 	return 0;
 }
 
+/* undo TW68_video_init1(), on remove and when probe fails after it */
+void TW68_video_fini1(struct TW68_dev *dev)
+{
+	del_timer_sync(&dev->delay_resync);
+
+	if (dev->capture_mode == TW68_CAPTURE_CONTIG)
+		vb2_dma_contig_cleanup_ctx(dev->alloc_ctx);
+	else if (dev->capture_mode == TW68_CAPTURE_SG)
+		vb2_dma_sg_cleanup_ctx(dev->alloc_ctx);
+	dev->alloc_ctx = NULL;
+}
+
 int TW68_video_init2(struct TW68_dev *dev)
 {
 	/* init video hw */
@@ -1919,165 +2358,87 @@ int TW68_video_init2(struct TW68_dev *dev)
 
 void TW68_irq_video_done(struct TW68_dev *dev, unsigned int nId, u32 dwRegPB)
 {
+	struct TW68_dmaqueue *q;
 	enum v4l2_field field;
+	u32 seq;
 	int Fn, PB;
 
 	Fn = (dwRegPB >> 24) & (1 << (nId - 1));
 	PB = (dwRegPB) & (1 << (nId - 1));
 
-	if ((dev->video_dmaq[0].DMA_nCH == 0xF) && ((nId - 1) < 4)) {
-		if ((dev->video_dmaq[0].curr)) {
-			dev->video_dmaq[0].FieldPB = dwRegPB;
-			QF_Field_Copy(dev, (nId - 1), Fn, PB);
-			dev->QFbit |= (1 << (nId - 1));
-
-			if ((dev->QFbit & 0xF) == 0xF) {
-				dev->QFbit = 0;
-				TW68_buffer_finish(dev, &dev->video_dmaq[0],
-						   VIDEOBUF_DONE);
-				TW68_buffer_next(dev, &(dev->video_dmaq[0]));
-			}
-
-		}
+	/* the channel is a tile of a mosaic, of this board or another */
+	if (dev->tile[nId - 1]) {
+		TW68_mosaic_done(dev->tile[nId - 1], Fn, PB);
 		return;
 	}
 
-	if (dev->video_dmaq[nId].curr) {
+	if (dev->capture_mode == TW68_CAPTURE_CONTIG) {
+		BD_Done(dev, nId - 1, Fn, PB);
 		dev->video_fieldcount[nId]++;
-		field = dev->video_dmaq[nId].curr->vb.field;
-
-		dev->video_dmaq[nId].curr->vb.field_count =
-		    dev->video_fieldcount[nId];
+		return;
+	}
 
-		Fn = (dwRegPB >> 24) & (1 << (nId - 1));
-		PB = (dwRegPB) & (1 << (nId - 1));
+	if (dev->capture_mode == TW68_CAPTURE_SG) {
+		SG_Done(dev, nId - 1, PB);
+		dev->video_fieldcount[nId]++;
+		return;
+	}
 
-		BF_Copy(dev, nId - 1, Fn, PB);
-		TW68_buffer_finish(dev, &dev->video_dmaq[nId], VIDEOBUF_DONE);
+	/* F2 frames belong to the sub-stream while that streams */
+	q = TW68_frame_queue(dev, nId - 1, Fn);
+	seq = dev->video_fieldcount[nId]++;
+	if (q->curr) {
+		field = q->curr->vb.v4l2_buf.field;
+
+		if (V4L2_FIELD_ALTERNATE == field) {
+			/*
+			 * one frame completes two buffers, sequence counts
+			 * fields and the top one ended a field period ago
+			 */
+			q->curr->vb.v4l2_buf.field = V4L2_FIELD_TOP;
+			q->curr->vb.v4l2_buf.sequence = seq * 2;
+			q->curr->early_us = dev->PAL50[nId] ? 20000 : 16683;
+			BF_Copy(dev, nId - 1, Fn, PB, V4L2_FIELD_TOP);
+			TW68_buffer_finish(dev, q, VB2_BUF_STATE_DONE);
+			if (NULL == q->curr)
+				return;
+			field = V4L2_FIELD_BOTTOM;
+			q->curr->vb.v4l2_buf.field = field;
+			q->curr->vb.v4l2_buf.sequence = seq * 2 + 1;
+		} else
+			q->curr->vb.v4l2_buf.sequence = seq;
+
+		BF_Copy(dev, nId - 1, Fn, PB, field);
 		// B field interrupt  program update  P field mapping
-		TW68_buffer_next(dev, &(dev->video_dmaq[nId]));
+		TW68_buffer_finish(dev, q, VB2_BUF_STATE_DONE);
 	}
 
 // done:
 	return;
 }
 
-int buffer_setup_QF(struct videobuf_queue *q, unsigned int *count,
+int buffer_setup_QF(struct vb2_queue *q, unsigned int *count,
 		    unsigned int *size)
 {
-	unsigned int ChannelOffset, nId, pgn;
-	u32 m_dwCHConfig, dwReg, dwRegH, dwRegW, nScaler, nW, nH, nSize;
-	u32 m_StartIdx, m_EndIdx, m_nVideoFormat,
-	    m_bHorizontalDecimate, m_bVerticalDecimate, m_nDropChannelNum,
-	    m_bDropMasterOrSlave, m_bDropField, m_bDropOddOrEven,
-	    m_nCurVideoChannelNum;
-
-	struct TW68_dev *dev;
-	struct TW68_fh *fh = q->priv_data;
-	dev = fh->dev;
-
-	dev->video_dmaq[0].DMA_nCH = 0xF;
-	dev->video_dmaq[0].curr = 0;
-	dev->QFbit = 0;
-
-	ChannelOffset = (PAGE_SIZE << 1) / 8 / 8;
-	// NTSC  FIELD entry number for 720*240*2
-	/// ChannelOffset = 128;   ///85;
+	struct TW68_fh *fh = vb2_get_drv_priv(q);
+	struct TW68_dmaqueue *qf = &fh->dev->video_dmaq[TW68_qid(fh)];
 
-	fh = q->priv_data;
+	qf->DMA_nCH = 0xF;
+	qf->curr = 0;
 
 	*size = fh->fmt->depth * fh->width * fh->height >> 3;	// calculate byte size for 1 frame
 
-	nW = fh->width / 2;
-	nH = fh->height / 2;
-	nSize = *size / 4;	// field size
-
-	for (nId = 0; nId < 4; nId++) {
-		if (nId < 4) {
-			dwReg = reg_readl(DECODER0_SDT + (nId * 0x10));
-			reg_writel(DECODER0_SDT + (nId * 0x10), 7);	/// 0 NTSC
-		}
-
-		DecoderResize(dev, nId, nH, nW);	// Field size
-
-		BFDMA_setup(dev, nId, fh->height / 2, (*size / fh->height / 2));	// BFbuf setup  DMA mode ...
-
-		if (0 == *count)
-			*count = gbuffers;
+	/* the tile channels are set up when streaming starts, they may be busy now */
+	qf->width = fh->width;
+	qf->height = fh->height;
+	qf->pitch = TW68_dma_pitch(fh->fmt, fh->width);
+	TW68_mosaic_geometry(qf->mosaic, fh->fmt, fh->width, fh->height);
 
-		/// pgn = (*size + PAGE_SIZE -1) /PAGE_SIZE;
-
-		pgn = TW68_buffer_pages(nSize) - 1;	// page number for 1 field
-
-		m_nDropChannelNum = 0;
-		m_bDropMasterOrSlave = 1;	// master
-		m_bDropField = 0;	////////////////////// 1
-		m_bDropOddOrEven = 0;
-		m_bHorizontalDecimate = 0;
-		m_bVerticalDecimate = 0;
-
-		m_StartIdx = ChannelOffset * nId;
-		m_EndIdx = m_StartIdx + pgn;	///pgn;  85 :: 720 * 480
-		m_nCurVideoChannelNum = 0;	// real-time video channel  starts 0
-		m_nVideoFormat = dev->nVideoFormat[nId];
-
-
-		m_dwCHConfig = (m_StartIdx & 0x3FF) |	// 10 bits
-		    ((m_EndIdx & 0x3FF) << 10) |	// 10 bits
-		    ((m_nVideoFormat & 7) << 20) |
-		    ((m_bHorizontalDecimate & 1) << 23) |
-		    ((m_bVerticalDecimate & 1) << 24) |
-		    ((m_nDropChannelNum & 3) << 25) |
-		    ((m_bDropMasterOrSlave & 1) << 27) |	// 1 bit
-		    ((m_bDropField & 1) << 28) |
-		    ((m_bDropOddOrEven & 1) << 29) |
-		    ((m_nCurVideoChannelNum & 3) << 30);
-
-		reg_writel(DMA_CH0_CONFIG + nId, m_dwCHConfig);
-		dwReg = reg_readl(DMA_CH0_CONFIG + nId);
-
-		//////external video decoder settings//////////////////////////////////////////////////////////////////////////
-
-		dwRegW = nW;
-		dwRegH = nH;	// field height
-
-		dwReg = dwRegW | (dwRegH << 16) | (1 << 31);
-		dwRegW = dwRegH = dwReg;
-
-		//Video Size
-		reg_writel(VIDEO_SIZE_REG, dwReg);	//for Rev.A backward compatible
-		reg_writel(VIDEO_SIZE_REG0 + nId, dwReg);	//for Rev.B or later only
-
-		//Scaler
-		dwRegW &= 0x7FF;
-		dwRegW = (720 * 256) / dwRegW;
-		dwRegH = (dwRegH >> 16) & 0x1FF;
-		// 60HZ video
-		dwRegH = (240 * 256) / dwRegH;
-
-		/// 0915  rev B  black ....
-		nScaler = VSCALE1_LO;	/// + (nId<<4); //VSCALE1_LO + 0|0x10|0x20|0x30
-
-		dwReg = dwRegH & 0xFF;	//V
-		nScaler++;	//VH
-
-		dwReg = (((dwRegH >> 8) & 0xF) << 4) | ((dwRegW >> 8) & 0xF);
-
-
-		/// reg_writel(nScaler,  dwReg);
-
-		nScaler++;	//H
-		dwReg = dwRegW & 0xFF;
-
-		//setup for Black stripe remover
-		dwRegW = fh->width;	///-12;  //EndPos
-		dwRegH = 4;	//StartPos
-		dwReg = (dwRegW - dwRegH) * (1 << 16) / fh->width;
-		dwReg = (dwRegH & 0x1F) |
-		    ((dwRegH & 0x3FF) << 5) | (dwReg << 15);
-		reg_writel(DROP_FIELD_REG0 + nId, 0xBFFFFFFF);	//28 // B 30 FPS
+	if (0 == *count)
+		*count = gbuffers;
+	while (*size * *count > VideoFrames_limit * 1024 * 1024 * 2)
+		(*count)--;
 
-	}
 	return 0;
 }
 
@@ -10,12 +10,14 @@
 #include <linux/delay.h>
 #include <linux/mutex.h>
 #include <linux/interrupt.h>
-#include <media/videobuf-vmalloc.h>
+#include <linux/workqueue.h>
+#include <media/videobuf2-vmalloc.h>
+#include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-dma-sg.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-device.h>
 #include <media/tuner.h>
-#include <media/videobuf-dma-sg.h>
 #include <sound/core.h>
 
 #define TW68_VERSION_CODE KERNEL_VERSION(2, 3, 1)
@@ -66,8 +68,24 @@ struct TW68_format {
 	unsigned int yuv:1;
 	unsigned int planar:1;
 	unsigned int uvswap:1;
+	unsigned int convert:1;	/* made from YUYV by the copy, see BF_Copy() */
+	unsigned int vf;	/* VIDEO_FORMAT_xxx the channel DMA writes */
 };
 
+/* bytes per line the channel DMA writes for fmt */
+static inline unsigned int TW68_dma_pitch(struct TW68_format *fmt,
+					  unsigned int width)
+{
+	return fmt->convert ? width * 2 : (width * fmt->depth) >> 3;
+}
+
+/* bytesperline userspace sees, the luma plane for planar formats */
+static inline unsigned int TW68_bytesperline(struct TW68_format *fmt,
+					     unsigned int width)
+{
+	return fmt->planar ? width : (width * fmt->depth) >> 3;
+}
+
 /* ----------------------------------------------------------- */
 /* card configuration                   */
 
@@ -130,7 +148,71 @@ struct TW68_board {
 
 #define RINGSIZE		8
 
+/* video buffer handling, selected by the capture_mode= module parameter */
+#define TW68_CAPTURE_COPY	0	/* DMA into BDbuf, memcpy into vb2-vmalloc buffers */
+#define TW68_CAPTURE_CONTIG	1	/* DMA straight into vb2-dma-contig buffers */
+#define TW68_CAPTURE_SG		2	/* page table DMA into vb2-dma-sg buffers */
+
+#define TW68_SG_ENTRIES		128	/* page table entries per channel and field */
+
+/* channel DMA decimation, see TW68_decoder_setup() */
+#define TW68_DECIMATE_H		1	/* every other pixel, DMA_CH0_CONFIG bit 23 */
+#define TW68_DECIMATE_V		2	/* every other line, DMA_CH0_CONFIG bit 24 */
+
+/* driver-private G_SELECTION target: the window the scaler samples */
+#define TW68_SEL_TGT_SAMPLED	0x1000
+
+/*
+ * video_device[] / video_dmaq[] index: 0 is the QF mux, 1-8 the main
+ * stream of DMA channel 0-7 (F1 set), 9-16 the sub-stream of channel
+ * 0-7, fed by the channel's second scaler and the BDMA F2 slots, and 17
+ * the second QF mux (inputs 4-7 by default).
+ */
+#define TW68_SUB_NODE		9
+#define TW68_QF2_NODE		17
+#define TW68_NODES		18
+
+#define TW68_MOSAICS		2	/* QF nodes 0 and TW68_QF2_NODE */
+#define TW68_MOSAIC_TILES	16	/* up to a 4x4 layout */
+#define TW68_QF_OPENED(i)	(1 << (16 + (i)))	/* video_opened bit of QF node i */
+
 struct TW68_dev;
+struct TW68_mosaic;
+
+/*
+ * One tile of the mosaic (QF) view: DMA channel ch of board src, scaled
+ * by its decoder to the tile and written at the tile's place
+ */
+struct TW68_tile {
+	struct TW68_dev *dev;		/* board of the mosaic device */
+	struct TW68_mosaic *m;		/* the mosaic */
+	struct TW68_dev *src;		/* board of the channel, while streaming */
+	unsigned int board, ch;		/* source as given in the layout */
+	unsigned int col, row, cols, rows;	/* rectangle in layout cells */
+	unsigned int width, height;	/* rectangle in pixels */
+	unsigned int dst_off;		/* byte offset in the mosaic frame */
+	unsigned int wbytes;		/* bytes of one tile line */
+	unsigned int pitch;		/* line pitch of the channel DMA */
+	int last;			/* BDbuf slot of its newest frame, -1 none */
+};
+
+struct TW68_mosaic {
+	struct TW68_dev *dev;
+	unsigned int node;		/* video_dmaq[] index of its QF node */
+	unsigned int cols, rows;	/* layout grid */
+	unsigned int ntiles;
+	struct TW68_tile tile[TW68_MOSAIC_TILES];
+	unsigned int deadline;		/* ms after the first tile, 0 waits for all */
+	unsigned int direct;		/* channels DMA into the QF buffers */
+	u32 vf;				/* VIDEO_FORMAT_xxx of the mosaic */
+	unsigned int fps;		/* S_PARM frame rate, 0 = full rate */
+	unsigned int pal;		/* 50 Hz, detected when its node opens */
+	struct TW68_buf *buf;		/* the frame being composed */
+	u32 done;			/* its tiles in place */
+	u32 gone;			/* its tiles whose board was removed */
+	unsigned long started;		/* jiffies when its first tile landed */
+	struct delayed_work expire;	/* deadline of that frame */
+};
 
 /* TW686_ DMA descriptor page table */
 struct TW68_pgtable {
@@ -151,14 +233,44 @@ struct TW68_thread {
 /* buffer for one video/vbi/ts frame */
 struct TW68_buf {
 	/* common v4l buffer stuff -- must be first */
-	struct videobuf_buffer vb;
+	struct vb2_buffer vb;
+	struct list_head queue;	/* TW68_dmaqueue.queued */
 	struct TW68_format *fmt;
+	unsigned int width, height, size;
 	unsigned int top_seen;
+	unsigned int early_us;	/* its picture ended this long before done */
+	unsigned int qf_given, qf_done;	/* quad view channels writing, done */
 	int (*activate) (struct TW68_dev * dev,
 			 struct TW68_buf * buf, struct TW68_buf * next);
 
 	/* page tables */
 	struct TW68_pgtable *pt;
+
+	/* SG mode descriptor chains, top and bottom field */
+	__le32 sgdesc[2][2 * TW68_SG_ENTRIES];
+};
+
+#define TW68_INT_REF_LOWLAT	0x38000		/* DMA_INT_REF, about one irq per field */
+#define TW68_INT_REF_HZ		125000000	/* DMA_INT_REF counts 8 ns ticks */
+
+/* deinterlacers of the copy pass, see TW68_copy_deinterlace() */
+#define TW68_DEINT_WEAVE	0
+#define TW68_DEINT_BOB		1
+#define TW68_DEINT_LINEAR	2
+#define TW68_DEINT_ADAPT	3
+
+#define TW68_EVENT_RING		16	/* field done events per channel, power of 2 */
+
+/*
+ * DMA_PB_STATUS snapshots handed from TW68_irq() to the channel work.
+ * One writer (hard irq) and one reader (the channel's work item), so
+ * head/tail need barriers but no lock.
+ */
+struct TW68_event_ring {
+	unsigned int head;		/* written by TW68_irq() only */
+	unsigned int tail;		/* written by TW68_video_work() only */
+	unsigned int lost;		/* events dropped on a full ring */
+	u32 dwRegPB[TW68_EVENT_RING];
 };
 
 struct TW68_dmaqueue {
@@ -171,6 +283,14 @@ struct TW68_dmaqueue {
 	unsigned int FieldPB;	/// Top Bottom status, field copy order;
 	unsigned int FCN;
 	struct timer_list restarter;
+	struct TW68_buf *slot[4];	/// buffers behind BDMA P, B, P_F2, B_F2
+	unsigned int sg_count;		/// SG descriptors per field
+	unsigned int sg_fieldsize;	/// SG bytes per field
+	__le32 sgdrop[2][2 * TW68_SG_ENTRIES];	/// SG chains into Field_P/Field_B
+	struct TW68_event_ring ring;	/// irq -> work field events
+	struct work_struct work;	/// per channel bottom half
+	unsigned int width, height, pitch;	/// format of the last queue_setup
+	struct TW68_mosaic *mosaic;	/// QF queues: their layout
 };
 
 /* video filehandle status */
@@ -192,11 +312,14 @@ struct TW68_fh {
 
 	//set default video standard and frame size
 	unsigned int dW, dH;	// default width hight
-	struct videobuf_queue cap;
+	unsigned int capture_mode;	/* TW68_CAPTURE_xxx of this queue */
+	unsigned int sub;	/* sub-stream node, captures the F2 frames */
+	unsigned int qf;	/* QF node: index of its mosaic */
+	enum v4l2_field field;
+	struct vb2_queue cap;
 	struct TW68_pgtable pt_cap;
 
 	/* vbi capture */
-	struct videobuf_queue vbi;
 	struct TW68_pgtable pt_vbi;
 };
 
@@ -224,7 +347,6 @@ struct TW68_dmasound {
 	unsigned int blksize;
 	unsigned int bufsize;
 	struct TW68_pgtable pt;
-	struct videobuf_dmabuf dma;
 	unsigned int dma_blk;
 	unsigned int read_offset;
 	unsigned int read_count;
@@ -270,11 +392,14 @@ struct video_ctrl {
 	int ctl_y_odd;
 	int ctl_y_even;
 	int ctl_automute;
+	int ctl_deinterlace;	/* TW68_DEINT_xxx for V4L2_FIELD_NONE */
 };
 
 struct dma_mem {
 	__le32 *cpu;
 	dma_addr_t dma_addr;
+	unsigned int size;
+	int streaming;		/* pci_map_single()'d pages, see BD_map() */
 };
 
 /* global device status */
@@ -296,22 +421,25 @@ struct TW68_dev {
 	unsigned int video_opened;
 	int video_DMA_1st_started;
 	int err_times;		/* DMA errors counter */
-	unsigned int vfd_DMA_num[9];
+	unsigned int vfd_DMA_num[TW68_NODES];
 	unsigned int deadbeef[9];
 	struct timer_list delay_resync;
-	unsigned int resources[16];
+	unsigned int resources[TW68_NODES];	/* by video_dmaq[] index */
 	struct video_device *video_dev;
-	struct video_device *video_device[9];	/// QF 0 + 8
-	struct dma_region Field_P[8];
+	struct video_device *video_device[TW68_NODES];	/// QF 0 + 8 + 8 sub
+	struct dma_region Field_P[8];	/* SG mode dropped fields, lazy */
 	struct dma_region Field_B[8];
 	unsigned int nVideoFormat[8];
-	struct dma_mem BDbuf[8][4];
+	struct dma_mem BDbuf[8][4];	/* allocated while the channel DMA runs */
+	unsigned int capture_mode;	/* TW68_CAPTURE_xxx */
+	void *alloc_ctx;		/* vb2 dma-contig/dma-sg context */
 	struct video_device *radio_dev;
 	struct video_device *vbi_dev;
 
 	/// DMA smart control
 	unsigned int videoDMA_ID;	/* DMA channels that should be active*/
 	unsigned int videoCap_ID;	/* DMA channels that are active */
+	unsigned int streaming;	/* bit ch: main, bit 8 + ch: sub-stream */
 	unsigned int videoRS_ID;	/* DMA channels to reset */
 	unsigned int videoDMA_run[8];	/* wtf is this for? */
 
@@ -322,6 +450,7 @@ struct TW68_dev {
 	int nr;
 	struct pci_dev *pci;
 	unsigned char pci_rev, pci_lat;
+	unsigned int msi;	/* irq is a private MSI vector */
 	__u32 __iomem *lmmio;
 	__u8 __iomem *bmmio;
 
@@ -342,14 +471,14 @@ struct TW68_dev {
 	/* video+ts+vbi capture */
 	struct TW68_dmaqueue video_q;
 	struct TW68_dmaqueue vbi_q;
-	unsigned int QFbit;	// Quad Frame interrupt bits
-	struct TW68_dmaqueue video_dmaq[9];
-	unsigned int video_fieldcount[9];
+	struct TW68_dmaqueue video_dmaq[TW68_NODES];
+	unsigned int video_fieldcount[TW68_NODES];
 
 	/* various v4l controls */
 	struct TW68_tvnorm *tvnorm;	/* video */
 	struct TW68_tvnorm *tvnormf[9];	/* video */
 	unsigned int PAL50[9];
+	unsigned int fps[9];	// S_PARM frame rate, 0 = full rate
 
 	unsigned int ctl_input;
 	int ctl_bright;
@@ -367,15 +496,26 @@ struct TW68_dev {
 
 	struct video_ctrl video_param[9];
 
-	/* crop */
-	struct v4l2_rect crop_bounds;
-	struct v4l2_rect crop_defrect;
-	struct v4l2_rect crop_current;
+	/* crop: decoder window of each channel, see TW68_crop_window() */
+	struct v4l2_rect crop[8];
+	u32 decimate[8];	/* TW68_DECIMATE_x of each channel's last setup */
 
 	/* other global state info */
-	unsigned int dwRegPB;	// PB flag for tasklet
-	unsigned int dwRegST;	// state for tasklet
-	struct tasklet_struct vid_tasklet;
+	struct workqueue_struct *vid_wq;	// runs video_dmaq[].work
+	u32 int_ref;		// DMA_INT_REF now programmed
+	u32 int_ref_max;	// ceiling from TW68_irq_moderate()
+	u32 irq_lastPB;		// DMA_PB_STATUS at the last interrupt
+	unsigned int irq_calm;	// interrupts since the last lost field
+	struct mutex qf_lock;	// QF frame is assembled by the tile channel works
+	struct TW68_mosaic mosaic[TW68_MOSAICS];	// layouts of the QF devices
+	struct TW68_tile *tile[8];	// mosaic tile a channel feeds, any board's
+	atomic_long_t dma_coherent;	// bytes held in BDbuf
+	atomic_long_t dma_sg;	// bytes held in Field_P/Field_B
+	atomic_long_t dma_pooled;	// of these parked in the pool
+	atomic_long_t dma_vb;	// vb2 capture buffers parked in the pool
+	struct list_head pool;	// released DMA buffers, see TW68_pool_park()
+	spinlock_t pool_lock;
+	unsigned int pool_count;
 };
 
 /* ----------------------------------------------------------- */
@@ -435,28 +575,117 @@ int TW68_buffer_queue(struct TW68_dev *dev,
 		      struct TW68_dmaqueue *q, struct TW68_buf *buf);
 
 void TW68_buffer_finish(struct TW68_dev *dev, struct TW68_dmaqueue *q,
-			unsigned int state);
-
-void TW68_buffer_next(struct TW68_dev *dev, struct TW68_dmaqueue *q);
+			enum vb2_buffer_state state);
 
 int TW68_buffer_requeue(struct TW68_dev *dev, struct TW68_dmaqueue *q);
 
 void DecoderResize(struct TW68_dev *dev, int nId, int H, int W);
+u32 TW68_decoder_setup(struct TW68_dev *dev, int nId, int H, int W);
+void TW68_crop_window(struct TW68_dev *dev, int nId, struct v4l2_rect *r);
+void TW68_scaler_window(struct TW68_dev *dev, int nId, int H, int W,
+			struct v4l2_rect *r);
 void Fixed_SG_Mapping(struct TW68_dev *dev, int nDMA_channel, int Frame_size);
-void BFDMA_setup(struct TW68_dev *dev, int nDMA_channel, int H, int W);
+void BFDMA_setup(struct TW68_dev *dev, int nDMA_channel, int H, int W, int P);
+void TW68_F2_setup(struct TW68_dev *dev, int nDMA_channel);
+
+struct TW68_dmaqueue *TW68_frame_queue(struct TW68_dev *dev,
+				       int nDMA_channel, u32 Fn);
+
+int BD_alloc(struct TW68_dev *dev, int nDMA_channel, unsigned int size);
+
+void BD_free(struct TW68_dev *dev, int nDMA_channel);
+
+int SG_field_alloc(struct TW68_dev *dev, int nDMA_channel,
+		   unsigned long size);
+
+void SG_field_free(struct TW68_dev *dev, int nDMA_channel);
+
+void TW68_pool_drain(struct TW68_dev *dev);
+
+const struct vb2_mem_ops *TW68_vb_memops(int capture_mode);
 
-int BF_Copy(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB);
+void TW68_bd_bench(struct TW68_dev *dev);
 
-int QF_Field_Copy(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB);
+/* ----------------------------------------------------------- */
+/* TW68-copy.c                                                 */
+
+void TW68_copy_init(void);
+
+void TW68_copy_frame(void *dst, const void *src, size_t n);
+
+void TW68_copy_rows(void *dst, size_t dpitch, const void *src, size_t spitch,
+		    size_t width, unsigned int rows);
+
+void TW68_copy_yuyv_420(void *dst, const void *src, unsigned int width,
+			unsigned int height, unsigned int spitch, int nv12);
+
+void TW68_copy_yuyv_grey(void *dst, const void *src, unsigned int width,
+			 unsigned int height, unsigned int spitch);
+
+void TW68_copy_deinterlace(void *dst, const void *src, unsigned int pitch,
+			   unsigned int lines, int mode);
+
+void TW68_copy_bench(struct TW68_dev *dev);
+
+/* ----------------------------------------------------------- */
+/* TW68-mosaic.c                                               */
+
+void TW68_mosaic_init(struct TW68_dev *dev);
+
+int TW68_mosaic_sysfs_add(struct TW68_dev *dev);
+
+void TW68_mosaic_sysfs_remove(struct TW68_dev *dev);
+
+void TW68_mosaic_geometry(struct TW68_mosaic *m, struct TW68_format *fmt,
+			  unsigned int width, unsigned int height);
+
+int TW68_mosaic_start(struct TW68_mosaic *m);
+
+void TW68_mosaic_stop(struct TW68_mosaic *m);
+
+void TW68_mosaic_board_gone(struct TW68_dev *dev);
+
+void TW68_mosaic_done(struct TW68_tile *t, u32 Fn, u32 PB);
+
+void BD_Start(struct TW68_dev *dev, int nDMA_channel);
+
+void BD_Release(struct TW68_dev *dev, int nDMA_channel, u32 slots);
+
+int BD_Done(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB);
+
+int BF_Copy(struct TW68_dev *dev, int nDMA_channel, u32 Fn, u32 PB,
+	    enum v4l2_field field);
+
+int SG_Chain(__le32 *desc, struct scatterlist *sglist, int sglen,
+	     unsigned int offset, unsigned int FieldSize, unsigned int count);
+
+void SGDMA_setup(struct TW68_dev *dev, int nDMA_channel);
+
+int SG_Start(struct TW68_dev *dev, int nDMA_channel);
+
+void SG_Release(struct TW68_dev *dev, int nDMA_channel);
+
+int SG_Done(struct TW68_dev *dev, int nDMA_channel, u32 PB);
+
+void QF_Start(struct TW68_mosaic *m);
+
+void QF_Release(struct TW68_mosaic *m);
+
+int QF_Done(struct TW68_tile *t, int n);
+
+int QF_Tile_Copy(struct TW68_tile *t, int n);
 
 void resync(unsigned long data);
 
 void TW68_buffer_timeout(unsigned long data);
 
-void TW68_dma_free(struct videobuf_queue *q, struct TW68_buf *buf);
+void TW68_buffer_cancel(struct TW68_dev *dev, struct TW68_dmaqueue *q,
+			enum vb2_buffer_state state);
 
 int TW68_set_dmabits(struct TW68_dev *dev, unsigned int DMA_nCH);
 
+void TW68_irq_moderate(struct TW68_dev *dev);
+
 int stop_video_DMA(struct TW68_dev *dev, unsigned int DMA_nCH);
 
 int Hardware_reset(struct TW68_dev *dev);
@@ -507,14 +736,17 @@ int TW68_videoport_init(struct TW68_dev *dev);
 
 int TW68_video_init1(struct TW68_dev *dev);
 
+void TW68_video_fini1(struct TW68_dev *dev);
+
 int TW68_video_init2(struct TW68_dev *dev);
 
 void TW68_irq_video_signalchange(struct TW68_dev *dev);
 
 void TW68_irq_video_done(struct TW68_dev *dev, unsigned int nId, u32 dwRegPB);
 
-int buffer_setup(struct videobuf_queue *q, unsigned int *count,
-		 unsigned int *size);
+int buffer_setup(struct vb2_queue *q, const struct v4l2_format *fmt,
+		 unsigned int *count, unsigned int *num_planes,
+		 unsigned int sizes[], void *alloc_ctxs[]);
 
-int buffer_setup_QF(struct videobuf_queue *q, unsigned int *count,
+int buffer_setup_QF(struct vb2_queue *q, unsigned int *count,
 		    unsigned int *size);
@@ -210,6 +210,11 @@
 #define HACTIVE_L2				0x12B
 #define HACTIVE_L3				0x13B
 
+// the F2 set mirrors CROP_H..HDELAY of F1 0x40 higher
+#define CROP_H0_F2				0x147
+#define CROP_H1_F2				0x157
+#define CROP_H2_F2				0x167
+#define CROP_H3_F2				0x177
 #define VDELAY0_F2				0x148
 #define VDELAY1_F2				0x158
 #define VDELAY2_F2				0x168
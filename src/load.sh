@@ -1,7 +1,8 @@
-modprobe videobuf_vmalloc
+modprobe videobuf2_vmalloc
 
 modprobe v4l2_common
-modprobe videobuf_dma_sg
+modprobe videobuf2_dma_sg
+modprobe videobuf2_dma_contig
 rmmod tw68v
 insmod tw68v.ko
 